@@ -8,10 +8,23 @@ Copyright (c) 2018 James Boer
 #include "Heady.h"
 
 #include <array>
+#include <bitset>
 #include <vector>
-#include <list>
+#include <deque>
 #include <map>
 #include <set>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <chrono>
 #include <filesystem>
 #include <string>
 #include <fstream>
@@ -19,106 +32,4213 @@ Copyright (c) 2018 James Boer
 #include <iostream>
 #include <algorithm>
 #include <iterator>
-#include <regex>
+#include <cctype>
+#include <cstring>
+#include <climits>
+#include <system_error>
+#include <cerrno>
+#include <optional>
+#include <random>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
 
 namespace Heady
 {
 	namespace Detail
 	{
-		// Forward declaration
-		void FindAndProcessLocalIncludes(const std::list<std::filesystem::directory_entry> & dirEntries, const std::filesystem::directory_entry & dirEntry, std::set<std::string> & processed, std::string & outputText);
+		// Split a list at whitespace
+		inline_t std::vector<std::string> Tokenize(std::string_view source)
+		{
+			const char * space = " \t\r\n\f\v";
+			std::vector<std::string> tokens;
+			for (auto first = source.find_first_not_of(space); first != std::string_view::npos;)
+			{
+				auto last = source.find_first_of(space, first);
+				tokens.emplace_back(source.substr(first, last - first));
+				first = source.find_first_not_of(space, last);
+			}
+			return tokens;
+		}
+
+		// Fast non-cryptographic 64-bit hash used to detect changed content
+		inline_t uint64_t HashBytes(std::string_view data, uint64_t seed = 0x9E3779B97F4A7C15ull)
+		{
+			const uint64_t multiplier = 0xFF51AFD7ED558CCDull;
+			uint64_t hash = seed ^ (data.size() * multiplier);
+			size_t pos = 0;
+			for (; pos + 8 <= data.size(); pos += 8)
+			{
+				uint64_t word;
+				std::memcpy(&word, data.data() + pos, sizeof(word));
+				hash = (hash ^ word) * multiplier;
+				hash ^= hash >> 32;
+			}
+			// An empty view may have no data to copy from
+			uint64_t tail = 0;
+			if (pos < data.size())
+				std::memcpy(&tail, data.data() + pos, data.size() - pos);
+			hash = (hash ^ tail) * multiplier;
+			hash ^= hash >> 29;
+			return hash;
+		}
+
+		// Read-only view of a file's contents.  Large regular files are memory-mapped so the
+		// contents can be lexed and emitted as string views without being copied.  Small
+		// files, pipes and other special files are read into an owned buffer.
+		class FileBuffer
+		{
+		public:
+			explicit FileBuffer(const std::filesystem::path & path)
+			{
+#if defined(_WIN32)
+				// Read in binary, as files are mapped elsewhere, so sizes and contents match the bytes
+				// on disk that outputs are compared against
+				std::ifstream file(path, std::ios::in | std::ios::binary);
+				if (!file)
+					throw std::filesystem::filesystem_error("Unable to open file", path, std::make_error_code(std::errc::no_such_file_or_directory));
+				m_buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+				m_data = m_buffer.data();
+				m_size = m_buffer.size();
+#else
+				Open(path.c_str());
+#endif
+			}
+
+			// Input files are opened by name, without converting it to a path unless there's an error
+#if defined(_WIN32)
+			explicit FileBuffer(const std::string & path) :
+				FileBuffer(std::filesystem::path(path))
+			{
+			}
+#else
+			explicit FileBuffer(const std::string & path)
+			{
+				Open(path.c_str());
+			}
+#endif
+
+			~FileBuffer()
+			{
+#if !defined(_WIN32)
+				if (m_mapped)
+					munmap(const_cast<char *>(m_data), m_size);
+#endif
+			}
+
+			FileBuffer(const FileBuffer &) = delete;
+			FileBuffer & operator = (const FileBuffer &) = delete;
+
+			std::string_view View() const { return std::string_view(m_data, m_size); }
+
+		private:
+#if !defined(_WIN32)
+			static constexpr off_t MapThreshold = 64 * 1024;
+
+			void Open(const char * path)
+			{
+				int fd = open(path, O_RDONLY | O_CLOEXEC);
+				if (fd < 0)
+					throw std::filesystem::filesystem_error("Unable to open file", path, std::error_code(errno, std::generic_category()));
+				struct stat st = {};
+				bool statValid = fstat(fd, &st) == 0;
+				if (statValid && S_ISDIR(st.st_mode))
+				{
+					// Directories have no contents to amalgamate
+					close(fd);
+					return;
+				}
+				// Small files are cheaper to read than to map, and each mapping counts against the
+				// process's limit, which trees of many small files would otherwise exhaust
+				if (statValid && S_ISREG(st.st_mode) && st.st_size >= MapThreshold)
+				{
+					void * addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+					if (addr != MAP_FAILED)
+					{
+						posix_madvise(addr, static_cast<size_t>(st.st_size), POSIX_MADV_SEQUENTIAL);
+						m_data = static_cast<const char *>(addr);
+						m_size = static_cast<size_t>(st.st_size);
+						m_mapped = true;
+						close(fd);
+						return;
+					}
+				}
+				if (statValid && S_ISREG(st.st_mode))
+					m_buffer.reserve(static_cast<size_t>(st.st_size));
+				ReadAll(fd, path);
+				close(fd);
+			}
+
+			void ReadAll(int fd, const char * path)
+			{
+				std::array<char, 64 * 1024> chunk;
+				for (;;)
+				{
+					ssize_t n = read(fd, chunk.data(), chunk.size());
+					if (n == 0)
+						break;
+					if (n < 0)
+					{
+						if (errno == EINTR)
+							continue;
+						std::error_code ec(errno, std::generic_category());
+						close(fd);
+						throw std::filesystem::filesystem_error("Unable to read file", path, ec);
+					}
+					m_buffer.append(chunk.data(), static_cast<size_t>(n));
+				}
+				m_data = m_buffer.data();
+				m_size = m_buffer.size();
+			}
+#endif
+
+			std::string m_buffer;
+			const char * m_data = nullptr;
+			size_t m_size = 0;
+			bool m_mapped = false;
+		};
+
+		// Monotonic arena holding the data structures of a run, which are released together when
+		// it ends.  Large blocks are taken from the upstream resource.  Files are lexed on several
+		// threads, so allocations are serialized.
+		class Arena : public std::pmr::memory_resource
+		{
+		public:
+			explicit Arena(std::pmr::memory_resource * upstream = nullptr) :
+				m_arena(InitialSize, upstream ? upstream : std::pmr::get_default_resource())
+			{
+			}
+
+		private:
+			static constexpr size_t InitialSize = 256 * 1024;
+
+			void * do_allocate(size_t bytes, size_t alignment) override
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				return m_arena.allocate(bytes, alignment);
+			}
+
+			void do_deallocate(void *, size_t, size_t) override
+			{
+			}
+
+			bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override
+			{
+				return this == &other;
+			}
+
+			std::mutex m_mutex;
+			std::pmr::monotonic_buffer_resource m_arena;
+		};
+
+		// Amalgamated output, held as a list of spans rather than one contiguous string.
+		// Spans either reference loaded input files, which must outlive the buffer, or small
+		// generated strings such as the begin/end file markers, and are written out in batches.
+		class OutputBuffer
+		{
+		public:
+			explicit OutputBuffer(std::pmr::memory_resource * memory = std::pmr::get_default_resource()) :
+				m_spans(memory),
+				m_generated(memory)
+			{
+			}
+
+			// Append a view of memory that outlives the buffer, such as a loaded input file
+			void Append(std::string_view text)
+			{
+				if (!text.empty())
+					m_spans.push_back({ text.data(), 0, text.size() });
+			}
+
+			// Append generated text, which is copied into the buffer's own storage
+			void AppendCopy(std::string_view text)
+			{
+				if (text.empty())
+					return;
+				if (!m_spans.empty() && !m_spans.back().data && m_spans.back().offset + m_spans.back().size == m_generated.size())
+					m_spans.back().size += text.size();
+				else
+					m_spans.push_back({ nullptr, m_generated.size(), text.size() });
+				m_generated += text;
+			}
+
+			// Compare against an existing file without reading it into memory
+			bool Matches(const std::filesystem::path & path) const
+			{
+				std::error_code ec;
+				if (!std::filesystem::is_regular_file(path, ec) || std::filesystem::file_size(path, ec) != Size() || ec)
+					return false;
+				FileBuffer file(path);
+				auto existing = file.View();
+				if (existing.size() != Size())
+					return false;
+				size_t pos = 0;
+				for (const auto & span : m_spans)
+				{
+					auto text = View(span);
+					if (existing.compare(pos, text.size(), text) != 0)
+						return false;
+					pos += text.size();
+				}
+				return true;
+			}
+
+			void Clear()
+			{
+				m_spans.clear();
+				m_generated.clear();
+			}
+
+			size_t Size() const
+			{
+				size_t size = 0;
+				for (const auto & span : m_spans)
+					size += span.size;
+				return size;
+			}
+
+			// Hand the spans to a sink in batches, without copying them
+			void Write(OutputSink & sink) const
+			{
+				std::vector<std::string_view> pieces;
+				pieces.reserve(std::min(BatchSize, m_spans.size()));
+				for (const auto & span : m_spans)
+				{
+					pieces.push_back(View(span));
+					if (pieces.size() == BatchSize)
+					{
+						sink.Write(pieces.data(), pieces.size());
+						pieces.clear();
+					}
+				}
+				if (!pieces.empty())
+					sink.Write(pieces.data(), pieces.size());
+			}
+
+			void Write(const std::filesystem::path & path) const
+			{
+#if defined(_WIN32)
+				// Written in binary, so the file holds exactly the bytes Matches compares against
+				std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+				if (!file)
+					throw std::filesystem::filesystem_error("Unable to create file", path, std::make_error_code(std::errc::permission_denied));
+				for (const auto & span : m_spans)
+				{
+					auto text = View(span);
+					file.write(text.data(), text.size());
+				}
+				file.close();
+				if (!file)
+					throw std::filesystem::filesystem_error("Unable to write file", path, std::make_error_code(std::errc::io_error));
+#else
+				int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+				if (fd < 0)
+					throw std::filesystem::filesystem_error("Unable to create file", path, std::error_code(errno, std::generic_category()));
+				try
+				{
+					FileDescriptorSink sink(fd);
+					Write(sink);
+				}
+				catch (const std::system_error & e)
+				{
+					close(fd);
+					throw std::filesystem::filesystem_error("Unable to write file", path, e.code());
+				}
+				if (close(fd) != 0)
+					throw std::filesystem::filesystem_error("Unable to write file", path, std::error_code(errno, std::generic_category()));
+#endif
+			}
+
+		private:
+			static constexpr size_t BatchSize = 1024;
+
+			struct Span
+			{
+				// Null data refers to an offset within the generated text
+				const char * data;
+				size_t offset;
+				size_t size;
+			};
+
+			std::string_view View(const Span & span) const
+			{
+				if (span.data)
+					return std::string_view(span.data, span.size);
+				return std::string_view(m_generated.data() + span.offset, span.size);
+			}
+
+			std::pmr::vector<Span> m_spans;
+			std::pmr::string m_generated;
+		};
+
+		enum class EditType
+		{
+			LocalInclude,
+			InlineMacro,
+			SystemInclude,
+			PragmaOnce,
+			Conditional,
+			Define,
+		};
+
+		// A range of input text that is replaced rather than copied verbatim during emission
+		struct Edit
+		{
+			EditType type;
+			size_t begin;
+			size_t end;
+			std::string_view name;
+		};
+
+		inline_t bool IsIdentifierChar(char c)
+		{
+			return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+		}
+
+		inline_t bool IsHorizontalSpace(char c)
+		{
+			return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+		}
+
+		inline_t bool IsSpace(char c)
+		{
+			return c == '\n' || IsHorizontalSpace(c);
+		}
+
+		inline_t size_t SkipLineComment(std::string_view text, size_t pos)
+		{
+			// A backslash-newline continues a line comment onto the next line
+			while (pos < text.size())
+			{
+				pos = text.find('\n', pos);
+				if (pos == std::string_view::npos)
+					return text.size();
+				size_t prev = pos;
+				while (prev > 0 && text[prev - 1] == '\r')
+					--prev;
+				if (prev == 0 || text[prev - 1] != '\\')
+					return pos;
+				++pos;
+			}
+			return text.size();
+		}
+
+		inline_t size_t SkipBlockComment(std::string_view text, size_t pos)
+		{
+			pos = text.find("*/", pos + 2);
+			return pos == std::string_view::npos ? text.size() : pos + 2;
+		}
+
+		inline_t size_t SkipQuoted(std::string_view text, size_t pos, char quote)
+		{
+			// An unterminated literal stops at the end of the line, which keeps stray
+			// apostrophes in directives like #error from swallowing the rest of the file
+			for (++pos; pos < text.size(); ++pos)
+			{
+				if (text[pos] == '\\')
+					++pos;
+				else if (text[pos] == quote)
+					return pos + 1;
+				else if (text[pos] == '\n')
+					return pos;
+			}
+			return text.size();
+		}
+
+		inline_t size_t SkipRawString(std::string_view text, size_t pos)
+		{
+			// pos is the opening quote of R"delimiter( ... )delimiter"
+			size_t open = text.find('(', pos + 1);
+			if (open == std::string_view::npos)
+				return text.size();
+			auto delimiter = text.substr(pos + 1, open - pos - 1);
+			for (size_t close = text.find(')', open + 1); close != std::string_view::npos; close = text.find(')', close + 1))
+			{
+				size_t quote = close + 1 + delimiter.size();
+				if (quote < text.size() && text[quote] == '"' && text.compare(close + 1, delimiter.size(), delimiter) == 0)
+					return quote + 1;
+			}
+			return text.size();
+		}
+
+		inline_t std::string_view PrecedingToken(std::string_view text, size_t pos, bool allowQuote)
+		{
+			size_t start = pos;
+			while (start > 0 && (IsIdentifierChar(text[start - 1]) || (allowQuote && text[start - 1] == '\'')))
+				--start;
+			return text.substr(start, pos - start);
+		}
+
+		inline_t bool IsImplementationFile(std::string_view name)
+		{
+			auto dot = name.rfind('.');
+			if (dot == std::string_view::npos || name.find('/', dot) != std::string_view::npos)
+				return false;
+			auto extension = name.substr(dot + 1);
+			return extension == "c" || extension == "cc" || extension == "cpp" || extension == "cxx" || extension == "c++";
+		}
+
+		inline_t bool IsRawStringPrefix(std::string_view token)
+		{
+			return token == "R" || token == "u8R" || token == "uR" || token == "UR" || token == "LR";
+		}
+
+		// State carried across a file's directives to decide which system includes can be hoisted
+		// out of it.  Only includes outside of braces, of conditional blocks other than an include
+		// guard, and ahead of any macro the file defines or undefines qualify.
+		struct LexState
+		{
+			int conditionalDepth = 0;
+			int braceDepth = 0;
+			bool seenCode = false;
+			bool defined = false;
+			std::string_view guard;
+			bool guardDefined = false;
+			bool guardClosed = false;
+			std::vector<size_t> guarded;
+		};
+
+		inline_t std::string_view ReadIdentifier(std::string_view text, size_t & i)
+		{
+			while (i < text.size() && IsHorizontalSpace(text[i]))
+				++i;
+			size_t start = i;
+			while (i < text.size() && IsIdentifierChar(text[i]))
+				++i;
+			return text.substr(start, i - start);
+		}
+
+		// End of the directive starting at pos, following line continuations and comments, and
+		// excluding trailing whitespace
+		inline_t size_t DirectiveEnd(std::string_view text, size_t pos)
+		{
+			size_t end = pos;
+			while (pos < text.size())
+			{
+				char c = text[pos];
+				if (c == '\\' && pos + 1 < text.size() && (text[pos + 1] == '\n' || text[pos + 1] == '\r'))
+				{
+					pos = text.find('\n', pos);
+					if (pos == std::string_view::npos)
+						break;
+					++pos;
+					continue;
+				}
+				if (c == '\n')
+					break;
+				if (c == '/' && pos + 1 < text.size() && text[pos + 1] == '/')
+					pos = SkipLineComment(text, pos + 2);
+				else if (c == '/' && pos + 1 < text.size() && text[pos + 1] == '*')
+					pos = SkipBlockComment(text, pos);
+				else if (c == '"' || c == '\'')
+					pos = SkipQuoted(text, pos, c);
+				else
+					++pos;
+				if (!IsSpace(c))
+					end = pos;
+			}
+			return end;
+		}
+
+		inline_t bool IsConditionalKeyword(std::string_view keyword)
+		{
+			return keyword == "if" || keyword == "ifdef" || keyword == "ifndef" || keyword == "elif" || keyword == "elifdef" ||
+				keyword == "elifndef" || keyword == "else" || keyword == "endif";
+		}
+
+		inline_t size_t ParseDirective(std::string_view text, size_t pos, std::vector<Edit> & edits, LexState & state)
+		{
+			// pos is the '#' introducing a preprocessor directive.  Returns the position at
+			// which lexing should resume.
+			size_t i = pos + 1;
+			auto keyword = ReadIdentifier(text, i);
+
+			// Leading whitespace, including preceding line breaks, is consumed along with a removed directive
+			auto lineBegin = [&]()
+			{
+				size_t first = edits.empty() ? 0 : edits.back().end;
+				size_t begin = pos;
+				while (begin > first && IsSpace(text[begin - 1]))
+					--begin;
+				return begin;
+			};
+
+			// Conditionals are recorded with their whole line so they can be dropped when pruning, and
+			// defines as a position, named by the directive following the '#'
+			if (IsConditionalKeyword(keyword) || keyword == "define" || keyword == "undef")
+			{
+				size_t end = DirectiveEnd(text, i);
+				auto directive = text.substr(i - keyword.size(), end - (i - keyword.size()));
+				if (keyword == "define" || keyword == "undef")
+					edits.push_back({ EditType::Define, pos, pos, directive });
+				else
+					edits.push_back({ EditType::Conditional, lineBegin(), end, directive });
+			}
+
+			// Anything following a closed include guard means it wasn't one.  A #pragma once may
+			// precede the guard.
+			bool first = !state.seenCode;
+			if (keyword != "pragma")
+				state.seenCode = true;
+			if (state.guardClosed)
+				state.guard = {};
+			bool guardScope = !state.guard.empty() && state.conditionalDepth == 1;
+			bool hoistable = state.braceDepth == 0 && (state.conditionalDepth == 0 || guardScope);
+
+			if (keyword == "include")
+			{
+				while (i < text.size() && IsHorizontalSpace(text[i]))
+					++i;
+				if (i >= text.size() || (text[i] != '"' && text[i] != '<'))
+					return pos + 1;
+				size_t close = text.find_first_of(text[i] == '"' ? "\"\n" : ">\n", i + 1);
+				if (close == std::string_view::npos || text[close] == '\n' || close == i + 1)
+					return pos + 1;
+				auto name = text.substr(i + 1, close - i - 1);
+				if (text[i] == '"')
+					edits.push_back({ EditType::LocalInclude, lineBegin(), close + 1, name });
+				else if (hoistable && !state.defined)
+				{
+					if (state.conditionalDepth)
+						state.guarded.push_back(edits.size());
+					edits.push_back({ EditType::SystemInclude, lineBegin(), close + 1, name });
+				}
+				return close + 1;
+			}
+			if (keyword == "pragma")
+			{
+				if (ReadIdentifier(text, i) == "once" && hoistable)
+				{
+					if (state.conditionalDepth)
+						state.guarded.push_back(edits.size());
+					edits.push_back({ EditType::PragmaOnce, lineBegin(), i, text.substr(i - 4, 4) });
+				}
+			}
+			else if (keyword == "ifndef" && first)
+			{
+				state.guard = ReadIdentifier(text, i);
+				state.conditionalDepth++;
+			}
+			else if (keyword == "if" || keyword == "ifdef" || keyword == "ifndef")
+				state.conditionalDepth++;
+			else if (keyword == "elif" || keyword == "else")
+			{
+				if (guardScope)
+					state.guard = {};
+			}
+			else if (keyword == "endif" && state.conditionalDepth > 0)
+			{
+				state.guardClosed = guardScope;
+				state.conditionalDepth--;
+			}
+			else if (keyword == "define" && guardScope && !state.guardDefined && ReadIdentifier(text, i) == state.guard)
+				state.guardDefined = true;
+			else if (keyword == "define" || keyword == "undef")
+				state.defined = true;
+			return pos + 1;
+		}
+
+		inline_t void LexFile(std::string_view text, std::string_view inlineMacro, std::vector<Edit> & edits)
+		{
+			// Walk the text once, skipping over comments and string, character and raw string
+			// literals.  Records every quoted #include directive found at the start of a line,
+			// every occurrence of the inline macro identifier outside of directives other than
+			// #define bodies, the system includes and #pragma once directives that could be
+			// hoisted, and the conditional and define directives used for pruning.
+			edits.clear();
+			LexState state;
+			bool lineStart = true;
+			bool directive = false;
+			size_t macroBody = std::string_view::npos;
+			auto code = [&]()
+			{
+				lineStart = false;
+				if (!directive)
+				{
+					state.seenCode = true;
+					if (state.guardClosed)
+						state.guard = {};
+				}
+			};
+			size_t pos = 0;
+			while (pos < text.size())
+			{
+				char c = text[pos];
+				if (c == '\n')
+				{
+					// A backslash-newline continues the current logical line
+					size_t prev = pos;
+					while (prev > 0 && text[prev - 1] == '\r')
+						--prev;
+					if (prev == 0 || text[prev - 1] != '\\')
+					{
+						lineStart = true;
+						directive = false;
+					}
+					++pos;
+				}
+				else if (IsHorizontalSpace(c))
+				{
+					++pos;
+				}
+				else if (c == '/' && pos + 1 < text.size() && text[pos + 1] == '/')
+				{
+					pos = SkipLineComment(text, pos + 2);
+				}
+				else if (c == '/' && pos + 1 < text.size() && text[pos + 1] == '*')
+				{
+					// A block comment is a single space, even when it spans lines, so a directive only
+					// follows it if the comment itself began a line
+					pos = SkipBlockComment(text, pos);
+				}
+				else if (c == '#' && lineStart)
+				{
+					// The macro is substituted in the body of a #define, but not as the name being defined
+					size_t i = pos + 1;
+					macroBody = std::string_view::npos;
+					if (ReadIdentifier(text, i) == "define")
+					{
+						ReadIdentifier(text, i);
+						macroBody = i;
+					}
+					lineStart = false;
+					directive = true;
+					pos = ParseDirective(text, pos, edits, state);
+				}
+				else if (c == '"')
+				{
+					code();
+					if (IsRawStringPrefix(PrecedingToken(text, pos, false)))
+						pos = SkipRawString(text, pos);
+					else
+						pos = SkipQuoted(text, pos, '"');
+				}
+				else if (c == '\'')
+				{
+					// Apostrophes following a numeric literal are digit separators
+					code();
+					auto token = PrecedingToken(text, pos, true);
+					if (!token.empty() && std::isdigit(static_cast<unsigned char>(token.front())))
+						++pos;
+					else
+						pos = SkipQuoted(text, pos, '\'');
+				}
+				else if (IsIdentifierChar(c))
+				{
+					// Consume whole identifiers and numbers so the macro only matches complete tokens
+					code();
+					size_t end = pos + 1;
+					while (end < text.size() && IsIdentifierChar(text[end]))
+						++end;
+					if ((!directive || pos >= macroBody) && !std::isdigit(static_cast<unsigned char>(c)) && text.substr(pos, end - pos) == inlineMacro)
+						edits.push_back({ EditType::InlineMacro, pos, end, inlineMacro });
+					pos = end;
+				}
+				else
+				{
+					code();
+					if (!directive && c == '{')
+						state.braceDepth++;
+					else if (!directive && c == '}')
+						state.braceDepth--;
+					++pos;
+				}
+			}
+
+			// System includes within a conditional block can only be hoisted if it was an include guard
+			if (!state.guarded.empty() && (state.guard.empty() || !state.guardDefined || !state.guardClosed))
+			{
+				size_t next = 0;
+				size_t kept = 0;
+				for (size_t index = 0; index < edits.size(); ++index)
+				{
+					if (next < state.guarded.size() && state.guarded[next] == index)
+						++next;
+					else
+						edits[kept++] = edits[index];
+				}
+				edits.resize(kept);
+			}
+		}
+
+		// Removes comments from text passed through it piece by piece, leaving literals intact and
+		// dropping lines left blank.  When minifying, whitespace is also collapsed to a single space
+		// where one is needed to keep tokens apart, and only the line breaks that end preprocessor
+		// directives are kept.  Comments and literals never span pieces, since pieces are
+		// split at includes and macros, but pieces from different files are interleaved, so each
+		// file's position within a line is tracked separately.
+		class CommentStripper
+		{
+		public:
+			struct Input
+			{
+				bool lineStart = true;
+				bool directive = false;
+			};
+
+			explicit CommentStripper(bool minify) :
+				m_minify(minify)
+			{
+			}
+
+			void Process(std::string_view text, Input & input, std::string & out)
+			{
+				m_inputBytes += text.size();
+				size_t pos = 0;
+				auto token = [&](size_t end)
+				{
+					input.lineStart = false;
+					Emit(text.substr(pos, end - pos), input, out);
+					pos = end;
+				};
+				while (pos < text.size())
+				{
+					char c = text[pos];
+					size_t splice = pos + 1;
+					while (splice < text.size() && text[splice] == '\r')
+						++splice;
+					if (c == '\\' && splice < text.size() && text[splice] == '\n')
+					{
+						// Line splices only need keeping if line breaks are
+						if (m_minify)
+						{
+							m_pendingSpace = true;
+							pos = splice + 1;
+						}
+						else
+							token(splice + 1);
+					}
+					else if (c == '\n')
+					{
+						input.lineStart = true;
+						if (input.directive || !m_minify)
+							EndLine(out);
+						else
+							m_pendingSpace = true;
+						input.directive = false;
+						++pos;
+					}
+					else if (IsHorizontalSpace(c))
+					{
+						if (m_minify)
+							m_pendingSpace = true;
+						else
+							m_pendingBlank += c;
+						++pos;
+					}
+					else if (c == '/' && pos + 1 < text.size() && (text[pos + 1] == '/' || text[pos + 1] == '*'))
+					{
+						// A removed comment still separates the tokens around it
+						bool block = text[pos + 1] == '*';
+						pos = block ? SkipBlockComment(text, pos) : SkipLineComment(text, pos + 2);
+						if (m_minify)
+							m_pendingSpace = true;
+						else if (block && m_pendingBlank.empty())
+							m_pendingBlank = " ";
+					}
+					else if (c == '#' && input.lineStart)
+					{
+						StartLine(out);
+						input.directive = true;
+						token(pos + 1);
+					}
+					else if (c == '"')
+						token(IsRawStringPrefix(PrecedingToken(text, pos, false)) ? SkipRawString(text, pos) : SkipQuoted(text, pos, '"'));
+					else if (c == '\'')
+					{
+						// Apostrophes following a numeric literal are digit separators
+						auto preceding = PrecedingToken(text, pos, true);
+						if (!preceding.empty() && std::isdigit(static_cast<unsigned char>(preceding.front())))
+						{
+							out += c;
+							m_last = c;
+							++pos;
+						}
+						else
+							token(SkipQuoted(text, pos, '\''));
+					}
+					else if (IsIdentifierChar(c))
+					{
+						size_t end = pos + 1;
+						while (end < text.size() && IsIdentifierChar(text[end]))
+							++end;
+						token(end);
+					}
+					else
+						token(pos + 1);
+				}
+			}
+
+			// The text that follows isn't adjacent to the text before, such as at the start of a file
+			void Break(std::string & out)
+			{
+				if (m_minify)
+					m_pendingSpace = true;
+				else
+					EndLine(out);
+			}
+
+			// Finish a file's text, ending a directive left on its last line
+			void Finish(Input & input, std::string & out)
+			{
+				if (input.directive)
+					EndLine(out);
+				input.directive = false;
+				Break(out);
+			}
+
+			// Finish the output with a line break
+			void Close(std::string & out)
+			{
+				if (m_minify ? m_last != '\n' : m_lineHasContent)
+					EndLine(out);
+			}
+
+			// Count text that was left out entirely, such as file markers
+			void Skip(size_t size) { m_inputBytes += size; }
+
+			uintmax_t InputBytes() const { return m_inputBytes; }
+
+		private:
+			void Emit(std::string_view token, const Input & input, std::string & out)
+			{
+				if (m_minify)
+				{
+					// Spaces are significant in directives, such as after a macro name
+					char first = token.front();
+					bool space = m_pendingSpace && m_last != '\n' && (input.directive || NeedsSpace(m_last, first, m_number));
+					if (space)
+						out += ' ';
+					m_pendingSpace = false;
+
+					// A preprocessing number starts with a digit and takes in the letters, digits and
+					// periods that follow it, and the sign after an exponent
+					bool adjacent = !space && m_last != '\n';
+					if (std::isdigit(static_cast<unsigned char>(first)))
+						m_number = true;
+					else if (!adjacent || !(IsIdentifierChar(first) || first == '.' || IsExponentSign(m_last, first)))
+						m_number = false;
+				}
+				else
+				{
+					out += m_pendingBlank;
+					m_pendingBlank.clear();
+					m_lineHasContent = true;
+				}
+				out += token;
+				m_last = token.back();
+			}
+
+			void StartLine(std::string & out)
+			{
+				if (m_minify ? m_last != '\n' : m_lineHasContent)
+					EndLine(out);
+			}
+
+			void EndLine(std::string & out)
+			{
+				if (m_minify || m_lineHasContent)
+				{
+					out += '\n';
+					m_last = '\n';
+				}
+				m_lineHasContent = false;
+				m_pendingSpace = false;
+				m_pendingBlank.clear();
+			}
+
+			static bool IsExponentSign(char left, char right)
+			{
+				return (right == '+' || right == '-') && left && std::strchr("eEpP", left) != nullptr;
+			}
+
+			static bool NeedsSpace(char left, char right, bool number)
+			{
+				// Words, and literals next to words, would merge, as would adjacent operators, and a
+				// sign following a number ending in an exponent letter, such as 0xE + 1
+				auto word = [](char c) { return IsIdentifierChar(c) || c == '"' || c == '\''; };
+				auto op = [](char c) { return c && std::strchr("+-*/%&|^!=<>.:#?", c) != nullptr; };
+				return (word(left) && word(right) && (IsIdentifierChar(left) || IsIdentifierChar(right))) || (op(left) && op(right)) ||
+					(number && IsExponentSign(left, right));
+			}
+
+			bool m_minify;
+			bool m_pendingSpace = false;
+			bool m_lineHasContent = false;
+			bool m_number = false;
+			char m_last = '\n';
+			std::string m_pendingBlank;
+			uintmax_t m_inputBytes = 0;
+		};
+
+		// The comments at the start of a file, ahead of any code, which are usually its license
+		inline_t std::string_view LeadingComments(std::string_view text)
+		{
+			size_t pos = 0;
+			size_t end = 0;
+			while (pos < text.size())
+			{
+				if (IsSpace(text[pos]))
+					++pos;
+				else if (text.compare(pos, 2, "//") == 0)
+					end = pos = SkipLineComment(text, pos + 2);
+				else if (text.compare(pos, 2, "/*") == 0)
+					end = pos = SkipBlockComment(text, pos);
+				else
+					break;
+			}
+			size_t begin = text.find('/');
+			return end ? text.substr(begin, end - begin) : std::string_view();
+		}
+
+		// Macros assumed defined or undefined while pruning, with the value of each where it's a
+		// known integer.  Preprocessor conditions are evaluated against them, and any condition
+		// that depends on another macro is left undecided.
+		class MacroTable
+		{
+		public:
+			void Define(const std::string & name, std::optional<int64_t> value) { m_macros[name] = { true, value }; }
+			void Undefine(const std::string & name) { m_macros[name] = { false, std::nullopt }; }
+			void Forget(const std::string & name) { m_macros.erase(name); }
+			bool Tracks(const std::string & name) const { return m_macros.count(name) != 0; }
+
+			// Evaluate a conditional directive, starting with its keyword, returning nothing if
+			// it can't be decided
+			std::optional<bool> Evaluate(std::string_view directive) const
+			{
+				size_t pos = 0;
+				auto keyword = ReadIdentifier(directive, pos);
+				if (keyword == "else")
+					return true;
+				if (keyword == "ifdef" || keyword == "ifndef" || keyword == "elifdef" || keyword == "elifndef")
+				{
+					auto itr = m_macros.find(std::string(ReadIdentifier(directive, pos)));
+					if (itr == m_macros.end())
+						return std::nullopt;
+					return itr->second.defined == (keyword == "ifdef" || keyword == "elifdef");
+				}
+				auto value = Parser{ *this, directive, pos }.Parse();
+				return value ? std::optional<bool>(*value != 0) : std::nullopt;
+			}
+
+			// Evaluate the body of a macro definition that contains only constants
+			static std::optional<int64_t> EvaluateBody(std::string_view body)
+			{
+				return Parser{ MacroTable(), body, 0 }.Parse();
+			}
+
+		private:
+			struct Macro
+			{
+				bool defined;
+				std::optional<int64_t> value;
+			};
+
+			// Recursive descent over a #if expression, where an empty value is undecided
+			struct Parser
+			{
+				using Value = std::optional<int64_t>;
+
+				const MacroTable & macros;
+				std::string_view text;
+				size_t pos;
+				bool failed = false;
+
+				Value Parse()
+				{
+					auto value = Conditional();
+					Skip();
+					return failed || pos < text.size() ? std::nullopt : value;
+				}
+
+				void Skip()
+				{
+					while (pos < text.size())
+					{
+						if (IsSpace(text[pos]) || (text[pos] == '\\' && pos + 1 < text.size() && IsSpace(text[pos + 1])))
+							++pos;
+						else if (text.compare(pos, 2, "//") == 0)
+							pos = SkipLineComment(text, pos + 2);
+						else if (text.compare(pos, 2, "/*") == 0)
+							pos = SkipBlockComment(text, pos);
+						else
+							break;
+					}
+				}
+
+				// Consume an operator, unless it's the start of a longer one
+				bool Accept(std::string_view op)
+				{
+					Skip();
+					if (text.compare(pos, op.size(), op) != 0)
+						return false;
+					if (op.size() == 1 && pos + 1 < text.size())
+					{
+						char next = text[pos + 1];
+						if ((next == op[0] && std::strchr("|&<>", next)) || (next == '=' && std::strchr("<>!", op[0])))
+							return false;
+					}
+					pos += op.size();
+					return true;
+				}
+
+				Value Conditional()
+				{
+					auto condition = LogicalOr();
+					if (!Accept("?"))
+						return condition;
+					auto left = Conditional();
+					if (!Accept(":"))
+						failed = true;
+					auto right = Conditional();
+					if (condition)
+						return *condition ? left : right;
+					return left && right && *left == *right ? left : std::nullopt;
+				}
+
+				Value LogicalOr()
+				{
+					auto left = LogicalAnd();
+					while (Accept("||"))
+					{
+						auto right = LogicalAnd();
+						if ((left && *left) || (right && *right))
+							left = 1;
+						else if (left && right)
+							left = 0;
+						else
+							left = std::nullopt;
+					}
+					return left;
+				}
+
+				Value LogicalAnd()
+				{
+					auto left = Binary(0);
+					while (Accept("&&"))
+					{
+						auto right = Binary(0);
+						if ((left && !*left) || (right && !*right))
+							left = 0;
+						else if (left && right)
+							left = 1;
+						else
+							left = std::nullopt;
+					}
+					return left;
+				}
+
+				// Binary operators from lowest to highest precedence
+				Value Binary(size_t level)
+				{
+					static const std::array<std::array<std::string_view, 4>, 8> levels = { {
+						{ "|" }, { "^" }, { "&" }, { "==", "!=" }, { "<=", ">=", "<", ">" }, { "<<", ">>" }, { "+", "-" }, { "*", "/", "%" },
+					} };
+					if (level == levels.size())
+						return Unary();
+					auto left = Binary(level + 1);
+					for (;;)
+					{
+						std::string_view op;
+						for (auto candidate : levels[level])
+						{
+							if (!candidate.empty() && Accept(candidate))
+							{
+								op = candidate;
+								break;
+							}
+						}
+						if (op.empty())
+							return left;
+						auto right = Binary(level + 1);
+						left = left && right ? Apply(op, *left, *right) : std::nullopt;
+					}
+				}
+
+				static Value Apply(std::string_view op, int64_t left, int64_t right)
+				{
+					auto wrap = [](uint64_t value) { return static_cast<int64_t>(value); };
+					auto l = static_cast<uint64_t>(left);
+					auto r = static_cast<uint64_t>(right);
+					switch (op[0])
+					{
+					case '|': return left | right;
+					case '^': return left ^ right;
+					case '&': return left & right;
+					case '=': return left == right;
+					case '!': return left != right;
+					case '+': return wrap(l + r);
+					case '-': return wrap(l - r);
+					case '*': return wrap(l * r);
+					case '/':
+					case '%':
+						if (right == 0 || (left == INT64_MIN && right == -1))
+							return std::nullopt;
+						return op[0] == '/' ? left / right : left % right;
+					case '<':
+					case '>':
+						if (op.size() == 2 && op[1] == op[0])
+						{
+							if (right < 0 || right > 63)
+								return std::nullopt;
+							return op[0] == '<' ? wrap(l << right) : left >> right;
+						}
+						if (op.size() == 2)
+							return op[0] == '<' ? left <= right : left >= right;
+						return op[0] == '<' ? left < right : left > right;
+					}
+					return std::nullopt;
+				}
+
+				Value Unary()
+				{
+					if (Accept("!"))
+					{
+						auto value = Unary();
+						return value ? Value(!*value) : value;
+					}
+					if (Accept("~"))
+					{
+						auto value = Unary();
+						return value ? Value(~*value) : value;
+					}
+					if (Accept("-"))
+					{
+						auto value = Unary();
+						return value ? Value(static_cast<int64_t>(0 - static_cast<uint64_t>(*value))) : value;
+					}
+					if (Accept("+"))
+						return Unary();
+					return Primary();
+				}
+
+				Value Primary()
+				{
+					Skip();
+					if (Accept("("))
+					{
+						auto value = Conditional();
+						if (!Accept(")"))
+							failed = true;
+						return value;
+					}
+					if (pos >= text.size())
+					{
+						failed = true;
+						return std::nullopt;
+					}
+					if (std::isdigit(static_cast<unsigned char>(text[pos])))
+						return Number();
+					if (text[pos] == '\'')
+					{
+						pos = SkipQuoted(text, pos, '\'');
+						return std::nullopt;
+					}
+					auto name = ReadIdentifier(text, pos);
+					if (name.empty())
+					{
+						failed = true;
+						return std::nullopt;
+					}
+					if (name == "defined")
+					{
+						bool parenthesized = Accept("(");
+						Skip();
+						auto itr = macros.m_macros.find(std::string(ReadIdentifier(text, pos)));
+						if (parenthesized && !Accept(")"))
+							failed = true;
+						return itr == macros.m_macros.end() ? Value() : Value(itr->second.defined);
+					}
+					if (name == "true" || name == "false")
+						return name == "true";
+
+					// Function-like macros and operators such as __has_include are never decided
+					Skip();
+					if (pos < text.size() && text[pos] == '(')
+					{
+						for (int depth = 0; pos < text.size(); ++pos)
+						{
+							depth += text[pos] == '(';
+							depth -= text[pos] == ')';
+							if (depth == 0)
+								break;
+						}
+						if (pos++ >= text.size())
+							failed = true;
+						return std::nullopt;
+					}
+					auto itr = macros.m_macros.find(std::string(name));
+					if (itr == macros.m_macros.end())
+						return std::nullopt;
+					return itr->second.defined ? itr->second.value : Value(0);
+				}
+
+				Value Number()
+				{
+					int base = 10;
+					if (text.compare(pos, 2, "0x") == 0 || text.compare(pos, 2, "0X") == 0)
+					{
+						base = 16;
+						pos += 2;
+					}
+					else if (text.compare(pos, 2, "0b") == 0 || text.compare(pos, 2, "0B") == 0)
+					{
+						base = 2;
+						pos += 2;
+					}
+					else if (text[pos] == '0')
+						base = 8;
+					uint64_t value = 0;
+					bool overflow = false;
+					for (; pos < text.size(); ++pos)
+					{
+						char c = static_cast<char>(std::tolower(static_cast<unsigned char>(text[pos])));
+						int digit = std::isdigit(static_cast<unsigned char>(c)) ? c - '0' : (c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1);
+						if (c == '\'')
+							continue;
+						if (digit < 0 || digit >= base)
+							break;
+						overflow |= value > (UINT64_MAX - digit) / base;
+						value = value * base + digit;
+					}
+					while (pos < text.size() && std::strchr("uUlL", text[pos]))
+						++pos;
+					if (pos < text.size() && IsIdentifierChar(text[pos]))
+						failed = true;
+					if (overflow || value > static_cast<uint64_t>(INT64_MAX))
+						return std::nullopt;
+					return static_cast<int64_t>(value);
+				}
+			};
+
+			std::unordered_map<std::string, Macro> m_macros;
+		};
+
+		// Decides which branches of each file's conditionals are emitted while files are visited.
+		// Branches that can't be decided are kept along with their directives, and the directives
+		// of decided branches are dropped, or rewritten where an undecided branch precedes them.
+		class ConditionalPruner
+		{
+		public:
+			explicit ConditionalPruner(MacroTable macros) :
+				m_macros(std::move(macros))
+			{
+			}
+
+			// A file included from an undecided branch inherits its uncertainty
+			void Begin()
+			{
+				bool uncertain = Uncertain();
+				m_files.emplace_back();
+				m_files.back().uncertain = uncertain;
+			}
+
+			void End()
+			{
+				m_files.pop_back();
+			}
+
+			bool Live() const
+			{
+				return m_files.empty() || m_files.back().groups.empty() || m_files.back().groups.back().live;
+			}
+
+			// Decide a conditional directive.  Returns whether it's emitted, along with the keyword
+			// that replaces its own, if any.
+			bool Conditional(std::string_view directive, std::string_view & keyword)
+			{
+				keyword = {};
+				size_t pos = 0;
+				auto original = ReadIdentifier(directive, pos);
+				auto & groups = m_files.back().groups;
+				if (original == "if" || original == "ifdef" || original == "ifndef")
+				{
+					bool parentLive = Live();
+					groups.push_back({ parentLive, false, false, false, true });
+					if (!parentLive)
+						return false;
+					return Branch(groups.back(), m_macros.Evaluate(directive), original, keyword);
+				}
+				if (groups.empty())
+					return true;
+				auto & group = groups.back();
+				if (original == "endif")
+				{
+					bool kept = group.parentLive && group.kept;
+					groups.pop_back();
+					return kept;
+				}
+				if (!group.parentLive)
+					return false;
+				if (group.taken)
+				{
+					group.live = false;
+					return false;
+				}
+				return Branch(group, m_macros.Evaluate(directive), original, keyword);
+			}
+
+			// Apply a #define or #undef of a tracked macro, which becomes unknown if it's only
+			// conditionally defined
+			void Define(std::string_view directive)
+			{
+				if (!Live())
+					return;
+				size_t pos = 0;
+				auto keyword = ReadIdentifier(directive, pos);
+				auto name = std::string(ReadIdentifier(directive, pos));
+				if (!m_macros.Tracks(name))
+					return;
+				if (Uncertain())
+					m_macros.Forget(name);
+				else if (keyword == "undef")
+					m_macros.Undefine(name);
+				else if (pos < directive.size() && directive[pos] == '(')
+					m_macros.Define(name, std::nullopt);
+				else
+					m_macros.Define(name, MacroTable::EvaluateBody(directive.substr(pos)));
+			}
+
+			const MacroTable & Macros() const { return m_macros; }
+
+		private:
+			struct Group
+			{
+				bool parentLive;
+				bool taken; // A branch was proven true, so the rest are dead
+				bool kept; // A directive of this group was emitted
+				bool live;
+				bool known; // The live branch is certain rather than undecided
+			};
+
+			struct File
+			{
+				std::vector<Group> groups;
+				bool uncertain = false;
+			};
+
+			bool Branch(Group & group, std::optional<bool> condition, std::string_view original, std::string_view & keyword)
+			{
+				bool wasKept = group.kept;
+				group.live = !condition || *condition;
+				group.known = condition.has_value() && !wasKept;
+				if (!group.live)
+					return false;
+				if (condition)
+				{
+					// A true branch following undecided ones becomes their #else
+					group.taken = true;
+					if (wasKept && original != "else")
+						keyword = "else";
+					return wasKept;
+				}
+
+				// The first undecided branch opens the conditional in place of dropped ones
+				group.kept = true;
+				if (!wasKept && original == "elif")
+					keyword = "if";
+				else if (!wasKept && original == "elifdef")
+					keyword = "ifdef";
+				else if (!wasKept && original == "elifndef")
+					keyword = "ifndef";
+				return true;
+			}
+
+			bool Uncertain() const
+			{
+				if (m_files.empty())
+					return false;
+				const auto & file = m_files.back();
+				return file.uncertain || std::any_of(file.groups.begin(), file.groups.end(), [](const Group & group) { return !group.known; });
+			}
+
+			MacroTable m_macros;
+			std::vector<File> m_files;
+		};
+
+		using FileId = uint32_t;
+
+		// Table of candidate input files, built once per run.  Each file is identified by
+		// its index, and local includes are resolved through a hash index of every
+		// component-aligned suffix of each file's path.
+		class FileTable
+		{
+		public:
+			static constexpr FileId InvalidId = ~FileId(0);
+
+			FileTable(std::vector<std::string> names, std::pmr::memory_resource * memory) :
+				m_names(std::make_move_iterator(names.begin()), std::make_move_iterator(names.end())),
+				m_listed(m_names.size()),
+				m_index(memory)
+			{
+				m_index.reserve(m_names.size() * 2);
+				for (FileId id = 0; id < m_names.size(); ++id)
+					Index(id);
+			}
+
+			// Add a file that wasn't listed, which is only reached through includes
+			FileId Add(std::string name)
+			{
+				m_names.push_back(std::move(name));
+				Index(static_cast<FileId>(m_names.size() - 1));
+				return static_cast<FileId>(m_names.size() - 1);
+			}
+
+			size_t Size() const { return m_names.size(); }
+
+			bool Listed(FileId id) const { return id < m_listed; }
+
+			const std::string & Name(FileId id) const { return m_names[id]; }
+
+			std::string_view Filename(FileId id) const
+			{
+				std::string_view name = m_names[id];
+				size_t pos = name.rfind('/');
+				return pos == std::string_view::npos ? name : name.substr(pos + 1);
+			}
+
+			// Find the file with exactly this interned name
+			FileId FindName(std::string_view name) const
+			{
+				auto itr = m_index.find(name);
+				return itr == m_index.end() || m_names[itr->second] != name ? InvalidId : itr->second;
+			}
+
+			// Find the file whose trailing path components exactly match the include
+			FileId Find(std::string_view include) const
+			{
+				std::string normalized;
+				if (include.find('\\') != std::string_view::npos)
+				{
+					normalized = include;
+					std::replace(normalized.begin(), normalized.end(), '\\', '/');
+					include = normalized;
+				}
+
+				// Leading relative components can't be resolved against a suffix, so they're ignored
+				while (include.compare(0, 2, "./") == 0 || include.compare(0, 3, "../") == 0)
+					include.remove_prefix(include.find('/') + 1);
+
+				auto itr = m_index.find(include);
+				return itr == m_index.end() ? InvalidId : itr->second;
+			}
+
+		private:
+			// Index views into the interned names, which never move.  Earlier files take precedence
+			// when several share a suffix.
+			void Index(FileId id)
+			{
+				std::string_view name = m_names[id];
+				for (size_t pos = name.rfind('/'); pos != std::string_view::npos; pos = pos ? name.rfind('/', pos - 1) : std::string_view::npos)
+					m_index.emplace(name.substr(pos + 1), id);
+				m_index.emplace(name, id);
+			}
+
+			std::deque<std::string> m_names;
+			size_t m_listed;
+			std::pmr::unordered_map<std::string_view, FileId> m_index;
+		};
+
+		// A loaded input file along with the edits found by lexing it
+		struct SourceFile
+		{
+			explicit SourceFile(std::pmr::memory_resource * memory) :
+				edits(memory),
+				includeNames(memory)
+			{
+			}
+
+			FileContents contents;
+			std::pmr::vector<Edit> edits;
+			std::pmr::string includeNames;
+			uintmax_t size = 0;
+			int64_t modified = 0;
+			uint64_t hash = 0;
+			bool cached = false;
+			bool lexed = false;
+			double readSeconds = 0.0;
+			double lexSeconds = 0.0;
+		};
+
+		// Lexing results from a previous run, stored next to the output file.  Entries are
+		// keyed by path and validated against the file's size and modification time, or
+		// failing that, a hash of its contents.  Edit names are stored as offsets into the
+		// file, so they become views into the newly mapped contents when reused.
+		class ScanCache
+		{
+		public:
+			struct CachedEdit
+			{
+				EditType type;
+				uint64_t begin;
+				uint64_t end;
+				uint64_t nameBegin;
+				uint64_t nameSize;
+			};
+
+			struct Entry
+			{
+				explicit Entry(std::pmr::memory_resource * memory) :
+					edits(memory)
+				{
+				}
+
+				uintmax_t size = 0;
+				int64_t modified = 0;
+				uint64_t hash = 0;
+				std::pmr::vector<CachedEdit> edits;
+			};
+
+			ScanCache(const std::filesystem::path & path, std::string_view inlineMacro, std::pmr::memory_resource * memory) :
+				m_path(path),
+				m_entries(memory)
+			{
+				// A missing, stale or corrupt cache is simply ignored
+				std::error_code ec;
+				if (!std::filesystem::is_regular_file(path, ec))
+					return;
+				try
+				{
+					m_file = std::make_unique<FileBuffer>(path);
+					Reader reader{ m_file->View() };
+					if (reader.String() != Magic || reader.String() != inlineMacro)
+						return;
+					auto count = reader.Number();
+					for (uint64_t i = 0; i < count && reader.valid; ++i)
+					{
+						auto name = reader.String();
+						Entry entry(memory);
+						entry.size = reader.Number();
+						entry.modified = static_cast<int64_t>(reader.Number());
+						entry.hash = reader.Number();
+						auto editCount = reader.Number();
+						uint64_t previousEnd = 0;
+						for (uint64_t e = 0; e < editCount && reader.valid; ++e)
+						{
+							CachedEdit edit = {};
+							edit.type = static_cast<EditType>(reader.Number());
+							edit.begin = previousEnd + reader.Number();
+							edit.end = edit.begin + reader.Number();
+							edit.nameBegin = edit.begin;
+							edit.nameSize = edit.end - edit.begin;
+							if (edit.type > EditType::Define)
+								reader.valid = false;
+							else if (edit.type != EditType::InlineMacro)
+							{
+								edit.nameBegin += reader.Number();
+								edit.nameSize = reader.Number();
+							}
+							if (edit.end > entry.size || edit.nameBegin + edit.nameSize > entry.size)
+								reader.valid = false;
+							previousEnd = edit.end;
+							entry.edits.push_back(edit);
+						}
+						if (reader.valid)
+							m_entries.emplace(name, std::move(entry));
+					}
+					if (!reader.valid)
+						m_entries.clear();
+				}
+				catch (const std::exception &)
+				{
+					m_entries.clear();
+				}
+			}
+
+			// Returns the cached edits for a file if they are still valid, rebased onto its new contents
+			bool Find(std::string_view name, SourceFile & source) const
+			{
+				auto itr = m_entries.find(name);
+				auto text = source.contents.text;
+				if (itr == m_entries.end() || itr->second.size != text.size())
+					return false;
+				const auto & entry = itr->second;
+				if (entry.modified != source.modified && HashBytes(text) != entry.hash)
+					return false;
+				source.hash = entry.hash;
+				source.edits.clear();
+				source.edits.reserve(entry.edits.size());
+				for (const auto & edit : entry.edits)
+					source.edits.push_back({ edit.type, edit.begin, edit.end, text.substr(edit.nameBegin, edit.nameSize) });
+				return true;
+			}
+
+			void Save(const FileTable & files, const std::pmr::vector<std::shared_ptr<SourceFile>> & sources, std::string_view inlineMacro) const
+			{
+				std::string data;
+				Writer writer{ data };
+				writer.String(Magic);
+				writer.String(inlineMacro);
+				writer.Number(files.Size());
+				for (FileId id = 0; id < files.Size(); ++id)
+				{
+					const auto & source = *sources[id];
+					auto text = source.contents.text;
+					writer.String(files.Name(id));
+					writer.Number(text.size());
+					writer.Number(static_cast<uint64_t>(source.modified));
+					writer.Number(source.hash);
+					// Edits are in file order, so offsets are stored relative to the previous edit.
+					// Inline macro names are the edit itself and need no separate range.
+					writer.Number(source.edits.size());
+					size_t previousEnd = 0;
+					for (const auto & edit : source.edits)
+					{
+						writer.Number(static_cast<uint64_t>(edit.type));
+						writer.Number(edit.begin - previousEnd);
+						writer.Number(edit.end - edit.begin);
+						if (edit.type != EditType::InlineMacro)
+						{
+							writer.Number(static_cast<uint64_t>(edit.name.data() - text.data()) - edit.begin);
+							writer.Number(edit.name.size());
+						}
+						previousEnd = edit.end;
+					}
+				}
+
+				// Write to a temporary file first, so an interrupted run never leaves a truncated cache
+				auto tempPath = m_path;
+				tempPath += ".tmp";
+				{
+					std::ofstream file(tempPath, std::ios::out | std::ios::binary | std::ios::trunc);
+					file.write(data.data(), data.size());
+					if (!file)
+						throw std::filesystem::filesystem_error("Unable to write scan cache", tempPath, std::make_error_code(std::errc::io_error));
+				}
+				std::filesystem::rename(tempPath, m_path);
+			}
+
+		private:
+			static constexpr std::string_view Magic = "HeadyScanCache6";
+
+			struct Reader
+			{
+				std::string_view data;
+				bool valid = true;
+
+				// Numbers are stored as variable-length 7-bit groups, least significant first
+				uint64_t Number()
+				{
+					uint64_t value = 0;
+					for (unsigned int shift = 0; shift < 64; shift += 7)
+					{
+						if (data.empty())
+							break;
+						auto byte = static_cast<uint8_t>(data.front());
+						data.remove_prefix(1);
+						value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+						if (!(byte & 0x80))
+							return value;
+					}
+					valid = false;
+					return 0;
+				}
+
+				std::string_view String()
+				{
+					auto size = Number();
+					if (size > data.size())
+					{
+						valid = false;
+						return {};
+					}
+					auto value = data.substr(0, size);
+					data.remove_prefix(size);
+					return value;
+				}
+			};
+
+			struct Writer
+			{
+				std::string & data;
+
+				void Number(uint64_t value)
+				{
+					while (value >= 0x80)
+					{
+						data.push_back(static_cast<char>((value & 0x7F) | 0x80));
+						value >>= 7;
+					}
+					data.push_back(static_cast<char>(value));
+				}
+
+				void String(std::string_view value)
+				{
+					Number(value.size());
+					data.append(value);
+				}
+			};
+
+			std::filesystem::path m_path;
+			std::unique_ptr<FileBuffer> m_file;
+			std::pmr::unordered_map<std::string_view, Entry> m_entries;
+		};
+
+		// State shared across the recursive include expansion of a single header.  Loaded files
+		// are shared, so headers generated together can reuse each other's files.
+		struct Context
+		{
+			Context(std::vector<std::string> names, std::pmr::memory_resource * memory) :
+				memory(memory),
+				files(std::move(names), memory),
+				sources(files.Size(), memory),
+				includes(memory),
+				processed(files.Size()),
+				output(memory),
+				shardOutputs(memory)
+			{
+			}
+
+			// Holds the file table, the loaded files and the output, and must outlive them
+			std::pmr::memory_resource * memory;
+			FileTable files;
+			std::pmr::vector<std::shared_ptr<SourceFile>> sources;
+			std::pmr::vector<std::pmr::vector<FileId>> includes;
+			std::vector<bool> processed;
+			std::vector<bool> onStack;
+			std::vector<bool> pruned;
+			std::vector<std::string> cycles;
+			bool hoistIncludes = false;
+			std::unique_ptr<MacroTable> macros; // Macros known when pruning conditionals, updated after the header is emitted
+			std::unique_ptr<CommentStripper> stripper;
+			uintmax_t unstrippedBytes = 0;
+			size_t hoistedIncludes = 0;
+			size_t hoistedDirectives = 0;
+			OutputBuffer output;
+			std::string inlineMacro;
+			std::vector<std::string> folders; // Subfolders walked when scanning recursively, listed in the depfile
+			std::vector<std::string> includable; // Files left out only for their extension, added to the table when a quoted include names one
+			std::vector<std::pair<std::string, FileId>> unlisted; // Includes no listed file matched, with the includable file each was resolved to
+
+			// When streaming, file contents are released after lexing, and each file is read again
+			// as it's emitted and flushed to the sink, so only the files on the include stack are held
+			bool streaming = false;
+			FileSystem * fileSystem = nullptr;
+			OutputSink * sink = nullptr;
+			uintmax_t flushedBytes = 0;
+
+			// When sharding, implementation files are left out of the header and split between
+			// the shards, in the order the header reached them
+			unsigned int shards = 0;
+			bool deferring = false;
+			std::vector<bool> deferred;
+			std::vector<FileId> deferredOrder;
+			std::pmr::vector<OutputBuffer> shardOutputs;
+
+			size_t includesAttempted = 0;
+			size_t includesResolved = 0;
+			size_t inlineSubstitutions = 0;
+		};
+
+		inline_t double SecondsSince(std::chrono::steady_clock::time_point start)
+		{
+			return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		inline_t void ReadSourceFile(SourceFile & source, FileSystem & fileSystem, const std::string & name)
+		{
+			auto start = std::chrono::steady_clock::now();
+			source.contents = fileSystem.Read(name);
+			source.size = source.contents.text.size();
+			source.readSeconds += SecondsSince(start);
+		}
+
+		inline_t void LexSourceFile(SourceFile & source, FileSystem & fileSystem, const std::string & name, std::string_view inlineMacro, const ScanCache * cache)
+		{
+			// Only files that changed since the cache was written need to be lexed again
+			auto start = std::chrono::steady_clock::now();
+			source.lexed = true;
+			if (cache)
+			{
+				source.modified = fileSystem.ModifiedTime(name);
+				source.cached = cache->Find(name, source);
+				if (source.cached)
+				{
+					source.readSeconds += SecondsSince(start);
+					return;
+				}
+				source.hash = HashBytes(source.contents.text);
+			}
+			source.readSeconds += SecondsSince(start);
+			start = std::chrono::steady_clock::now();
+
+			// Edits are gathered in a buffer kept by each thread, then copied to the file in one piece
+			thread_local std::vector<Edit> edits;
+			LexFile(source.contents.text, inlineMacro, edits);
+			source.edits.assign(edits.begin(), edits.end());
+			source.lexSeconds = SecondsSince(start);
+		}
+
+		// Source files are allocated from the memory of the context they're loaded for, and can only
+		// be shared with contexts using the same memory
+		inline_t std::shared_ptr<SourceFile> CreateSourceFile(std::pmr::memory_resource * memory)
+		{
+			return std::allocate_shared<SourceFile>(std::pmr::polymorphic_allocator<SourceFile>(memory), memory);
+		}
+
+		inline_t void LoadSourceFile(SourceFile & source, FileSystem & fileSystem, const std::string & name, std::string_view inlineMacro, const ScanCache * cache)
+		{
+			ReadSourceFile(source, fileSystem, name);
+			LexSourceFile(source, fileSystem, name, inlineMacro, cache);
+		}
+
+		// Run function(index) for every index below count on up to the given number of threads.
+		// Workers pull the next index from a shared cursor as soon as they finish their current
+		// one, and the first exception thrown is rethrown on the calling thread.
+		template <typename Function>
+		void ParallelFor(size_t count, unsigned int jobs, Function && function)
+		{
+			std::atomic<size_t> next = 0;
+			std::exception_ptr error;
+			std::mutex errorMutex;
+			auto worker = [&]()
+			{
+				for (size_t i = next++; i < count; i = next++)
+				{
+					try
+					{
+						function(i);
+					}
+					catch (...)
+					{
+						std::lock_guard<std::mutex> lock(errorMutex);
+						if (!error)
+							error = std::current_exception();
+						next = count;
+					}
+				}
+			};
+
+			if (jobs == 0)
+				jobs = std::max(1u, std::thread::hardware_concurrency());
+			jobs = static_cast<unsigned int>(std::min<size_t>(jobs, count));
+			std::vector<std::thread> threads;
+			for (unsigned int i = 1; i < jobs; ++i)
+				threads.emplace_back(worker);
+			worker();
+			for (auto & thread : threads)
+				thread.join();
+			if (error)
+				std::rethrow_exception(error);
+		}
+
+		// Sort work items so the largest are handed out first, and a few large files are started
+		// early rather than holding up the end of the phase
+		template <typename Item>
+		void SortLargestFirst(std::vector<std::pair<uintmax_t, Item>> & items)
+		{
+			std::stable_sort(items.begin(), items.end(), [](const auto & left, const auto & right)
+			{
+				return left.first > right.first;
+			});
+		}
+
+		// Copy include names out of a file's contents and release them, keeping only what's needed
+		// to order the file.  The contents are read again when the file is emitted, and must still
+		// match the hash taken here.
+		inline_t void ReleaseContents(SourceFile & source)
+		{
+			source.includeNames.clear();
+			for (const auto & edit : source.edits)
+			{
+				if (edit.type != EditType::InlineMacro)
+					source.includeNames += edit.name;
+			}
+			size_t offset = 0;
+			for (auto & edit : source.edits)
+			{
+				auto size = edit.type != EditType::InlineMacro ? edit.name.size() : 0;
+				edit.name = std::string_view(source.includeNames).substr(offset, size);
+				offset += size;
+			}
+			source.hash = HashBytes(source.contents.text);
+			source.contents = {};
+		}
+
+		// Add the includable files named by quoted includes that no file in the table matches.
+		// Returns whether any were added, which need loading in turn.
+		inline_t bool AddIncludedFiles(Context & context)
+		{
+			if (context.includable.empty())
+				return false;
+			std::unique_ptr<FileTable> includable;
+			std::unordered_set<std::string> unlisted;
+			for (const auto & include : context.unlisted)
+				unlisted.insert(include.first);
+			bool added = false;
+			for (FileId id = 0; id < context.sources.size(); ++id)
+			{
+				for (const auto & edit : context.sources[id]->edits)
+				{
+					if (edit.type != EditType::LocalInclude || context.files.Find(edit.name) != FileTable::InvalidId || unlisted.count(std::string(edit.name)))
+						continue;
+					if (!includable)
+						includable = std::make_unique<FileTable>(context.includable, context.memory);
+					auto include = includable->Find(edit.name);
+					if (include != FileTable::InvalidId)
+					{
+						include = context.files.Add(includable->Name(include));
+						added = true;
+					}
+					context.unlisted.emplace_back(edit.name, include);
+					unlisted.emplace(edit.name);
+				}
+			}
+			context.sources.resize(context.files.Size());
+			return added;
+		}
+
+		inline_t void LoadSourceFiles(Context & context, FileSystem & fileSystem, unsigned int jobs, const ScanCache * cache)
+		{
+			// Files that are already loaded are skipped, and files that were only read are lexed.
+			// Includable files reached from the loaded ones are then added and loaded the same way.
+			do
+			{
+				std::vector<std::pair<uintmax_t, FileId>> order;
+				order.reserve(context.files.Size());
+				for (FileId id = 0; id < context.files.Size(); ++id)
+				{
+					if (!context.sources[id] || !context.sources[id]->lexed)
+						order.emplace_back(fileSystem.SizeHint(context.files.Name(id)), id);
+				}
+				SortLargestFirst(order);
+				ParallelFor(order.size(), jobs, [&](size_t i)
+				{
+					auto id = order[i].second;
+					auto source = context.sources[id];
+					if (!source)
+					{
+						source = CreateSourceFile(context.memory);
+						ReadSourceFile(*source, fileSystem, context.files.Name(id));
+					}
+					LexSourceFile(*source, fileSystem, context.files.Name(id), context.inlineMacro, cache);
+					if (context.streaming)
+						ReleaseContents(*source);
+					context.sources[id] = std::move(source);
+				});
+			}
+			while (AddIncludedFiles(context));
+		}
+
+		// Hand everything emitted so far to the sink, so the files it refers to can be released
+		inline_t void FlushOutput(Context & context)
+		{
+			context.output.Write(*context.sink);
+			context.flushedBytes += context.output.Size();
+			context.output.Clear();
+		}
+
+		// Read a released file again, which must be what was lexed for the edits to apply to it
+		inline_t FileContents ReadForEmission(Context & context, FileId id)
+		{
+			auto contents = context.fileSystem->Read(context.files.Name(id));
+			if (contents.text.size() != context.sources[id]->size || HashBytes(contents.text) != context.sources[id]->hash)
+				throw std::runtime_error("File changed while generating header: " + context.files.Name(id));
+			return contents;
+		}
+
+		// Append generated text to the output, stripping it along with the files if needed
+		inline_t void AppendGenerated(Context & context, std::string_view text)
+		{
+			if (!context.stripper)
+			{
+				context.output.AppendCopy(text);
+				return;
+			}
+			std::string stripped;
+			CommentStripper::Input input;
+			context.stripper->Process(text, input, stripped);
+			context.output.AppendCopy(stripped);
+		}
+
+		// Resolve every local include once, giving each file's outgoing edges in the order they appear
+		inline_t void BuildIncludeGraph(Context & context)
+		{
+			context.includes.assign(context.files.Size(), {});
+			for (FileId id = 0; id < context.files.Size(); ++id)
+			{
+				auto & includes = context.includes[id];
+				for (const auto & edit : context.sources[id]->edits)
+				{
+					if (edit.type != EditType::LocalInclude)
+						continue;
+					auto include = context.files.Find(edit.name);
+					context.includesAttempted++;
+					context.includesResolved += include != FileTable::InvalidId;
+					includes.push_back(include);
+				}
+			}
+		}
+
+		// Walk a file and the includes it pulls in, depth first and in the order they're emitted,
+		// skipping files already walked.  The walk keeps its own stack, so include chains of any
+		// depth are safe, and an include of a file that's still being walked is reported as a
+		// cycle and skipped.  The visitor sees each file's text as the runs between its edits,
+		// along with each edit other than an include.
+		template <typename Visitor>
+		void VisitFile(Context & context, FileId root, Visitor & visitor)
+		{
+			struct Frame
+			{
+				FileId id;
+				size_t edit;
+				size_t include;
+				size_t pos;
+			};
+
+			std::vector<Frame> stack;
+			auto push = [&](FileId id)
+			{
+				context.processed[id] = true;
+				context.onStack[id] = true;
+				stack.push_back({ id, 0, 0, 0 });
+				visitor.Begin(id);
+			};
+			push(root);
+
+			while (!stack.empty())
+			{
+				auto & frame = stack.back();
+				const auto & edits = context.sources[frame.id]->edits;
+				if (frame.edit == edits.size())
+				{
+					visitor.End(frame.id, frame.pos);
+					context.onStack[frame.id] = false;
+					stack.pop_back();
+					continue;
+				}
+
+				// System includes and #pragma once are left in place unless they're being hoisted, and
+				// conditionals and defines unless they're being pruned or files are being deferred
+				const auto & edit = edits[frame.edit++];
+				if (!context.hoistIncludes && (edit.type == EditType::SystemInclude || edit.type == EditType::PragmaOnce))
+					continue;
+				if ((edit.type == EditType::Conditional || edit.type == EditType::Define) && !context.macros && !context.deferring)
+					continue;
+				visitor.Text(frame.id, frame.pos, edit.begin);
+				frame.pos = edit.end;
+				if (edit.type != EditType::LocalInclude)
+				{
+					visitor.Edit(edit);
+					continue;
+				}
+
+				auto include = context.includes[frame.id][frame.include++];
+				if (include == FileTable::InvalidId)
+					continue;
+				if (context.onStack[include])
+				{
+					std::string cycle;
+					auto itr = std::find_if(stack.begin(), stack.end(), [include](const auto & f) { return f.id == include; });
+					for (; itr != stack.end(); ++itr)
+						cycle += context.files.Name(itr->id) + " -> ";
+					context.cycles.push_back(cycle + context.files.Name(include));
+				}
+				else if (!context.processed[include])
+				{
+					if (visitor.Descend())
+						push(include);
+					else
+						context.pruned[include] = true;
+				}
+			}
+		}
+
+		// Start from files that no other file includes, so every file follows the files it depends
+		// on.  Files only reachable through an include cycle are visited afterwards, unless they
+		// were only included from pruned branches.
+		template <typename Visitor>
+		void VisitFiles(Context & context, const std::vector<uint32_t> & includedBy, Visitor & visitor)
+		{
+			context.processed.assign(context.files.Size(), false);
+			context.onStack.assign(context.files.Size(), false);
+			context.pruned.assign(context.files.Size(), false);
+			context.cycles.clear();
+			for (FileId id = 0; id < context.files.Size(); ++id)
+			{
+				if (!includedBy[id] && context.files.Listed(id))
+					VisitFile(context, id, visitor);
+			}
+
+			// Files only included from pruned files are pruned too
+			std::vector<FileId> pruned;
+			for (FileId id = 0; id < context.files.Size(); ++id)
+			{
+				if (context.pruned[id])
+					pruned.push_back(id);
+			}
+			while (!pruned.empty())
+			{
+				auto id = pruned.back();
+				pruned.pop_back();
+				for (auto include : context.includes[id])
+				{
+					if (include != FileTable::InvalidId && !context.processed[include] && !context.pruned[include])
+					{
+						context.pruned[include] = true;
+						pruned.push_back(include);
+					}
+				}
+			}
+			// Files added for an include are only emitted where they're included
+			for (FileId id = 0; id < context.files.Size(); ++id)
+			{
+				if (!context.processed[id] && !context.pruned[id] && context.files.Listed(id))
+					VisitFile(context, id, visitor);
+			}
+		}
+
+		// Appends visited files to the output, with begin and end markers around each unless
+		// comments are being stripped.  Deferred files are left out of the header, while their
+		// includes are still expanded, and are emitted afterwards without inline substitution.
+		// The conditionals around a deferred file's includes are kept in the header, along with
+		// the #define and #undef directives of deferred files that they test.
+		class Emitter
+		{
+		public:
+			Emitter(Context & context, OutputBuffer & output, bool deferred = false) :
+				m_context(context),
+				m_output(output),
+				m_deferred(deferred)
+			{
+				if (m_context.macros)
+					m_pruner = std::make_unique<ConditionalPruner>(*m_context.macros);
+			}
+
+			void Begin(FileId id)
+			{
+				bool skipped = !m_deferred && m_context.deferred[id];
+				if (skipped)
+					m_context.deferredOrder.push_back(id);
+				else
+				{
+					WritePendingConditionals();
+					Marker("\n\n// begin --- ", id);
+				}
+				if (m_pruner)
+					m_pruner->Begin();
+				m_files.emplace_back();
+				m_files.back().id = id;
+				m_files.back().skipped = skipped;
+			}
+
+			void Text(FileId id, size_t begin, size_t end)
+			{
+				if (!m_files.back().skipped && Live())
+					Write(Contents(id).substr(begin, end - begin));
+			}
+
+			void Edit(const Detail::Edit & edit)
+			{
+				// Hoisted directives are dropped, and the inline macro is replaced
+				if (edit.type == EditType::Conditional)
+					Conditional(edit);
+				else if (edit.type == EditType::Define)
+				{
+					// Defines in the header replace any carried over from deferred files
+					size_t pos = 0;
+					ReadIdentifier(edit.name, pos);
+					auto name = std::string(ReadIdentifier(edit.name, pos));
+					if (m_files.back().skipped)
+						m_carried[name] = { "#" + std::string(edit.name), false };
+					else
+					{
+						m_carried.erase(name);
+						if (m_pruner)
+							m_pruner->Define(edit.name);
+					}
+				}
+				else if (edit.type == EditType::InlineMacro && !m_files.back().skipped && Live())
+				{
+					if (m_deferred)
+						Write(m_context.inlineMacro);
+					else
+					{
+						m_context.inlineSubstitutions++;
+						Write("inline");
+					}
+				}
+			}
+
+			bool Descend()
+			{
+				// Includes within pruned branches aren't expanded
+				if (!Live())
+					return false;
+
+				// When streaming, what's been emitted is flushed before the include is read.  The
+				// current file is kept, since reading it again after the include could splice two
+				// versions of it together.
+				if (m_context.streaming)
+					FlushOutput(m_context);
+				return true;
+			}
+
+			void End(FileId id, size_t pos)
+			{
+				if (m_pruner)
+					m_pruner->End();
+				if (m_files.back().skipped)
+				{
+					m_files.pop_back();
+					return;
+				}
+				Write(Contents(id).substr(pos));
+				if (m_context.stripper)
+				{
+					m_buffer.clear();
+					m_context.stripper->Finish(m_files.back().input, m_buffer);
+					m_output.AppendCopy(m_buffer);
+				}
+				Marker("\n\n// end --- ", id);
+				if (m_context.streaming)
+					FlushOutput(m_context);
+				m_files.pop_back();
+			}
+
+			// Macros as they stand after the visited files, if pruning
+			const MacroTable * Macros() const
+			{
+				return m_pruner ? &m_pruner->Macros() : nullptr;
+			}
+
+		private:
+			bool Live() const
+			{
+				return !m_pruner || m_pruner->Live();
+			}
+
+			void Conditional(const Detail::Edit & edit)
+			{
+				std::string_view keyword;
+				if (m_pruner && !m_pruner->Conditional(edit.name, keyword))
+					return;
+				if (m_files.back().skipped)
+				{
+					PendConditional(edit.name, keyword);
+					return;
+				}
+				auto text = Contents(m_files.back().id).substr(edit.begin, edit.end - edit.begin);
+				if (keyword.empty())
+				{
+					Write(text);
+					return;
+				}
+
+				// Replace the keyword, keeping the condition unless it becomes an #else
+				size_t pos = 0;
+				ReadIdentifier(edit.name, pos);
+				Write(text.substr(0, text.size() - edit.name.size()));
+				Write(keyword);
+				if (keyword != "else")
+					Write(edit.name.substr(pos));
+			}
+
+			// A deferred file's conditionals are held until an include within them is emitted, and
+			// only closed in the header if they were opened there
+			void PendConditional(std::string_view directive, std::string_view keyword)
+			{
+				size_t pos = 0;
+				auto original = ReadIdentifier(directive, pos);
+				if (keyword.empty())
+					keyword = original;
+				auto & groups = m_files.back().groups;
+				if (keyword == "if" || keyword == "ifdef" || keyword == "ifndef")
+					groups.emplace_back();
+				if (groups.empty())
+					return;
+				if (keyword == "endif")
+				{
+					if (groups.back().written)
+						WriteDirective("#endif");
+					groups.pop_back();
+					return;
+				}
+				auto text = "#" + std::string(keyword);
+				if (keyword != "else")
+					text += directive.substr(pos);
+				groups.back().directives.push_back(std::move(text));
+			}
+
+			void WritePendingConditionals()
+			{
+				for (auto & file : m_files)
+				{
+					for (auto & group : file.groups)
+					{
+						for (; group.written < group.directives.size(); ++group.written)
+							WriteDirective(group.directives[group.written]);
+					}
+				}
+			}
+
+			// Write a directive on its own line, preceded by the carried defines it depends on
+			void WriteDirective(std::string_view directive)
+			{
+				size_t pos = 1;
+				auto keyword = ReadIdentifier(directive, pos);
+				if (keyword == "define" || keyword == "undef")
+					ReadIdentifier(directive, pos);
+				while (pos < directive.size())
+				{
+					// Numbers are skipped whole, so their suffixes aren't taken for macros
+					size_t start = pos;
+					while (pos < directive.size() && IsIdentifierChar(directive[pos]))
+						++pos;
+					if (pos == start)
+					{
+						++pos;
+						continue;
+					}
+					if (std::isdigit(static_cast<unsigned char>(directive[start])))
+						continue;
+					auto itr = m_carried.find(std::string(directive.substr(start, pos - start)));
+					if (itr != m_carried.end() && !itr->second.written)
+					{
+						itr->second.written = true;
+						WriteDirective(itr->second.directive);
+					}
+				}
+				Write("\n", false);
+				Write(directive, true);
+				Write("\n", false);
+			}
+
+			void Marker(std::string_view prefix, FileId id)
+			{
+				auto & output = m_output;
+				auto fn = m_context.files.Filename(id);
+				const std::string_view suffix = " --- \n\n";
+				if (m_context.stripper)
+				{
+					// An include may directly follow a directive, whose line must end before the
+					// included file starts
+					m_buffer.clear();
+					m_context.stripper->Skip(prefix.size() + fn.size() + suffix.size());
+					if (m_files.empty())
+						m_context.stripper->Break(m_buffer);
+					else
+						m_context.stripper->Finish(m_files.back().input, m_buffer);
+					output.AppendCopy(m_buffer);
+					return;
+				}
+				output.AppendCopy(prefix);
+				output.AppendCopy(fn);
+				output.AppendCopy(suffix);
+			}
+
+			void Write(std::string_view text, bool copy = false)
+			{
+				if (!m_context.stripper)
+				{
+					if (copy)
+						m_output.AppendCopy(text);
+					else
+						m_output.Append(text);
+					return;
+				}
+				m_buffer.clear();
+				m_context.stripper->Process(text, m_files.back().input, m_buffer);
+				m_output.AppendCopy(m_buffer);
+			}
+
+			std::string_view Contents(FileId id)
+			{
+				if (!m_context.streaming)
+					return m_context.sources[id]->contents.text;
+				auto & file = m_files.back();
+				if (!file.loaded)
+				{
+					file.contents = ReadForEmission(m_context, id);
+					file.loaded = true;
+				}
+				return file.contents.text;
+			}
+
+			// Conditional group of a deferred file, with the directives seen so far and how many of
+			// them have been written to the header
+			struct Group
+			{
+				std::vector<std::string> directives;
+				size_t written = 0;
+			};
+
+			struct File
+			{
+				FileId id = 0;
+				FileContents contents;
+				bool loaded = false;
+				bool skipped = false;
+				CommentStripper::Input input;
+				std::vector<Group> groups;
+			};
+
+			struct Carried
+			{
+				std::string directive;
+				bool written = false;
+			};
+
+			Context & m_context;
+			OutputBuffer & m_output;
+			bool m_deferred;
+			std::unique_ptr<ConditionalPruner> m_pruner;
+			std::vector<File> m_files;
+			std::unordered_map<std::string, Carried> m_carried;
+			std::string m_buffer;
+		};
+
+		// Collects each distinct system include in the order it would be emitted, leaving out
+		// those in pruned branches
+		struct HoistCollector
+		{
+			explicit HoistCollector(const Context & context) :
+				context(context),
+				seen(context.memory),
+				includes(context.memory)
+			{
+				if (context.macros)
+					pruner = std::make_unique<ConditionalPruner>(*context.macros);
+			}
+
+			void Text(FileId, size_t, size_t) {}
+
+			void Begin(FileId id)
+			{
+				if (pruner)
+					pruner->Begin();
+				deferred.push_back(context.deferred[id]);
+			}
+
+			bool Descend()
+			{
+				return !pruner || pruner->Live();
+			}
+
+			void End(FileId, size_t)
+			{
+				if (pruner)
+					pruner->End();
+				deferred.pop_back();
+			}
+
+			void Edit(const Detail::Edit & edit)
+			{
+				std::string_view keyword;
+				if (pruner && edit.type == EditType::Conditional)
+					pruner->Conditional(edit.name, keyword);
+				else if (pruner && edit.type == EditType::Define && !deferred.back())
+					pruner->Define(edit.name);
+				else if (!Descend())
+					return;
+				else if (edit.type == EditType::PragmaOnce)
+					pragmaOnce = true;
+				else if (edit.type == EditType::SystemInclude)
+				{
+					directives++;
+					if (seen.insert(edit.name).second)
+						includes.push_back(edit.name);
+				}
+			}
+
+			const Context & context;
+			std::unique_ptr<ConditionalPruner> pruner;
+			std::vector<bool> deferred;
+			bool pragmaOnce = false;
+			size_t directives = 0;
+			std::pmr::unordered_set<std::string_view> seen;
+			std::pmr::vector<std::string_view> includes;
+		};
+
+		// Sums the size of the files a shard unit expands to
+		struct ShardSizer
+		{
+			void Begin(FileId id) { bytes += context.sources[id]->size; }
+			void Text(FileId, size_t, size_t) {}
+			void Edit(const Detail::Edit &) {}
+			bool Descend() { return true; }
+			void End(FileId, size_t) {}
+
+			const Context & context;
+			uintmax_t bytes = 0;
+		};
+
+		// Split consecutive items into at most the given number of parts, minimizing the size of
+		// the largest part.  Returns the index each part starts at, followed by the item count.
+		inline_t std::vector<size_t> PartitionBySize(const std::vector<uintmax_t> & sizes, size_t parts)
+		{
+			// Find the smallest capacity that fits every item into the parts, then fill parts up to it,
+			// starting a new part early whenever there's one left for each remaining item
+			auto fits = [&](uintmax_t capacity)
+			{
+				size_t used = 1;
+				uintmax_t size = 0;
+				for (auto item : sizes)
+				{
+					if (size + item > capacity && size)
+					{
+						used++;
+						size = 0;
+					}
+					size += item;
+				}
+				return used <= parts;
+			};
+			uintmax_t low = 0;
+			uintmax_t high = 0;
+			for (auto item : sizes)
+			{
+				low = std::max(low, item);
+				high += item;
+			}
+			while (low < high)
+			{
+				auto middle = low + (high - low) / 2;
+				if (fits(middle))
+					high = middle;
+				else
+					low = middle + 1;
+			}
+
+			std::vector<size_t> starts(1, 0);
+			uintmax_t size = 0;
+			for (size_t i = 0; i < sizes.size(); ++i)
+			{
+				bool started = i > starts.back();
+				if (started && starts.size() < parts && (size + sizes[i] > low || sizes.size() - i <= parts - starts.size()))
+				{
+					starts.push_back(i);
+					size = 0;
+				}
+				size += sizes[i];
+			}
+			starts.resize(parts, sizes.size());
+			starts.push_back(sizes.size());
+			return starts;
+		}
+
+		inline_t std::filesystem::path ShardPath(const std::string & output, size_t index)
+		{
+			auto path = std::filesystem::path(output);
+			return path.replace_filename(path.stem().string() + "." + std::to_string(index + 1) + ".cpp");
+		}
+
+		// Files in the header count as already processed, so deferred files don't expand them again
+		inline_t void MarkHeaderProcessed(Context & context)
+		{
+			for (FileId id = 0; id < context.files.Size(); ++id)
+				context.processed[id] = !context.deferred[id];
+		}
+
+		// Emit the implementation files left out of the header into shards that each include the
+		// header.  Each file reached from a deferred file through other deferred files forms a
+		// unit, and consecutive units are grouped so the shards are of similar size.
+		inline_t void EmitShards(Context & context, const Params & params)
+		{
+			auto processed = context.processed;
+			auto cycles = context.cycles;
+			MarkHeaderProcessed(context);
+			std::vector<FileId> units;
+			std::vector<uintmax_t> sizes;
+			for (auto id : context.deferredOrder)
+			{
+				if (context.processed[id])
+					continue;
+				ShardSizer sizer{ context };
+				VisitFile(context, id, sizer);
+				units.push_back(id);
+				sizes.push_back(sizer.bytes);
+			}
+			auto starts = PartitionBySize(sizes, context.shards);
+
+			MarkHeaderProcessed(context);
+			auto include = "#include \"" + std::filesystem::path(params.output).filename().string() + "\"\n";
+			context.shardOutputs.clear();
+			context.shardOutputs.reserve(context.shards);
+			for (size_t shard = 0; shard < context.shards; ++shard)
+			{
+				auto & output = context.shardOutputs.emplace_back(context.memory);
+				output.AppendCopy(include);
+				if (context.stripper)
+					context.stripper = std::make_unique<CommentStripper>(params.minify);
+				Emitter emitter(context, output, true);
+				for (size_t unit = starts[shard]; unit < starts[shard + 1]; ++unit)
+					VisitFile(context, units[unit], emitter);
+				if (context.stripper)
+				{
+					std::string end;
+					context.stripper->Close(end);
+					output.AppendCopy(end);
+					context.unstrippedBytes += context.stripper->InputBytes();
+				}
+			}
+			context.processed = std::move(processed);
+			context.cycles = std::move(cycles);
+		}
+
+		// Emit the implementation files left out of the header at its end, behind a guard, so only
+		// the translation unit that defines the guard compiles them
+		inline_t void EmitImplementation(Context & context, const Params & params)
+		{
+			auto processed = context.processed;
+			auto cycles = context.cycles;
+			MarkHeaderProcessed(context);
+			AppendGenerated(context, "\n#ifdef " + params.implementation + "\n");
+			Emitter emitter(context, context.output, true);
+			for (auto id : context.deferredOrder)
+			{
+				if (!context.processed[id])
+					VisitFile(context, id, emitter);
+			}
+			AppendGenerated(context, "\n#endif // " + params.implementation + "\n");
+			context.processed = std::move(processed);
+			context.cycles = std::move(cycles);
+		}
+
+		// Glob pattern compiled into a sequence of steps, matched by tracking every step reached so
+		// far as a bit.  '*' and '?' match within a path component, '**' matches across components,
+		// "**/" matches any number of leading folders, and [...] matches a class of characters,
+		// negated by a leading '!' or '^'.
+		class Glob
+		{
+		public:
+			explicit Glob(std::string_view pattern)
+			{
+				for (size_t pos = 0; pos < pattern.size(); ++pos)
+				{
+					if (m_steps.size() == MaxSteps)
+						throw std::invalid_argument("Pattern is too long: " + std::string(pattern));
+					Step step = { Step::Set, {} };
+					if (pattern.compare(pos, 3, "**/") == 0)
+					{
+						step.kind = Step::Folders;
+						pos += 2;
+					}
+					else if (pattern.compare(pos, 2, "**") == 0)
+					{
+						step.kind = Step::AnyPath;
+						++pos;
+					}
+					else if (pattern[pos] == '*')
+						step.kind = Step::AnyName;
+					else if (pattern[pos] == '?')
+						step.characters.set().reset('/');
+					else if (pattern[pos] == '[' && ClassEnd(pattern, pos) != std::string_view::npos)
+					{
+						auto end = ClassEnd(pattern, pos);
+						bool negated = pattern[pos + 1] == '!' || pattern[pos + 1] == '^';
+						for (size_t i = pos + 1 + negated; i < end; ++i)
+						{
+							auto first = static_cast<unsigned char>(pattern[i]);
+							auto last = first;
+							if (i + 2 < end && pattern[i + 1] == '-')
+							{
+								last = static_cast<unsigned char>(pattern[i + 2]);
+								i += 2;
+							}
+							for (unsigned c = first; c <= last; ++c)
+								step.characters.set(c);
+						}
+						if (negated)
+							step.characters.flip();
+						step.characters.reset('/');
+						pos = end;
+					}
+					else
+						step.characters.set(static_cast<unsigned char>(pattern[pos]));
+					if (step.kind != Step::Set)
+						m_skippable |= uint64_t(1) << m_steps.size();
+					m_steps.push_back(step);
+				}
+			}
+
+			bool Matches(std::string_view text) const
+			{
+				uint64_t states = Skip(1);
+				for (char c : text)
+				{
+					// Leading folders end with a '/', so they can't be skipped once they've started
+					auto u = static_cast<unsigned char>(c);
+					uint64_t next = 0;
+					uint64_t folders = 0;
+					for (uint64_t active = states; active; active &= active - 1)
+					{
+						auto i = CountTrailingZeros(active);
+						if (i == m_steps.size())
+							continue;
+						const auto & step = m_steps[i];
+						if (step.kind == Step::Set)
+							next |= uint64_t(step.characters[u]) << (i + 1);
+						else if (step.kind == Step::Folders)
+						{
+							folders |= uint64_t(1) << i;
+							if (c == '/')
+								next |= uint64_t(2) << i;
+						}
+						else if (step.kind == Step::AnyPath || c != '/')
+							next |= uint64_t(1) << i;
+					}
+					states = Skip(next) | folders;
+					if (!states)
+						return false;
+				}
+				return (states >> m_steps.size()) & 1;
+			}
+
+		private:
+			// One bit per step, and one for the end of the pattern
+			static constexpr size_t MaxSteps = 63;
+
+			struct Step
+			{
+				enum Kind { Set, AnyName, AnyPath, Folders } kind;
+				std::bitset<256> characters;
+			};
+
+			static size_t ClassEnd(std::string_view pattern, size_t pos)
+			{
+				// A ']' first in the class is one of its characters
+				pos += 1;
+				if (pos < pattern.size() && (pattern[pos] == '!' || pattern[pos] == '^'))
+					++pos;
+				return pattern.find(']', pos + 1);
+			}
+
+			static size_t CountTrailingZeros(uint64_t value)
+			{
+				size_t count = 0;
+				for (; !(value & 1); value >>= 1)
+					++count;
+				return count;
+			}
+
+			// Wildcards may match nothing, so reaching one also reaches the step after it
+			uint64_t Skip(uint64_t states) const
+			{
+				for (size_t i = 0; i < m_steps.size(); ++i)
+				{
+					if ((states >> i) & (m_skippable >> i) & 1)
+						states |= uint64_t(2) << i;
+				}
+				return states;
+			}
+
+			std::vector<Step> m_steps;
+			uint64_t m_skippable = 0;
+		};
+
+		// Glob patterns indexed by a character they must start or end with, so that only those that
+		// could match a text are tried
+		class GlobIndex
+		{
+		public:
+			void Add(std::string_view pattern)
+			{
+				if (pattern.find_first_of("*?[") != 0)
+					m_byFirst[pattern.front()].emplace_back(pattern);
+				else if (pattern.find_first_of("*?]", pattern.size() - 1) == std::string_view::npos)
+					m_byLast[pattern.back()].emplace_back(pattern);
+				else
+					m_other.emplace_back(pattern);
+			}
+
+			bool Matches(std::string_view text) const
+			{
+				auto any = [text](const std::vector<Glob> & globs)
+				{
+					return std::any_of(globs.begin(), globs.end(), [text](const Glob & glob) { return glob.Matches(text); });
+				};
+				if (any(m_other))
+					return true;
+				if (text.empty())
+					return false;
+				auto last = m_byLast.find(text.back());
+				auto first = m_byFirst.find(text.front());
+				return (last != m_byLast.end() && any(last->second)) || (first != m_byFirst.end() && any(first->second));
+			}
+
+		private:
+			std::unordered_map<char, std::vector<Glob>> m_byLast;
+			std::unordered_map<char, std::vector<Glob>> m_byFirst;
+			std::vector<Glob> m_other;
+		};
+
+		// Set of glob patterns.  Patterns without a '/' match the last component of a path, others
+		// the whole path relative to the source folder, and a trailing '/' only matches folders.
+		// Plain names, plain paths and "*.ext" patterns are looked up in hash sets, and the rest are
+		// indexed by their first or last character, so the cost per entry stays flat as patterns
+		// are added.
+		class PatternSet
+		{
+		public:
+			void Add(std::string_view pattern)
+			{
+				bool folders = pattern.size() > 1 && pattern.back() == '/';
+				if (folders)
+					pattern.remove_suffix(1);
+				bool anchored = pattern.find('/') != std::string_view::npos;
+				while (pattern.compare(0, 2, "./") == 0)
+					pattern.remove_prefix(2);
+				if (!pattern.empty() && pattern.front() == '/')
+					pattern.remove_prefix(1);
+				if (pattern.empty())
+					return;
+
+				auto & group = m_groups[folders];
+				m_text.emplace_back(pattern);
+				pattern = m_text.back();
+				bool wildcards = pattern.find_first_of("*?[") != std::string_view::npos;
+				if (!wildcards)
+					(anchored ? group.paths : group.names).insert(pattern);
+				else if (!anchored && pattern.compare(0, 2, "*.") == 0 && pattern.find_first_of("*?[./", 2) == std::string_view::npos)
+					group.extensions.insert(pattern.substr(2));
+				else
+					(anchored ? group.pathGlobs : group.nameGlobs).Add(pattern);
+				m_empty = false;
+			}
+
+			bool Empty() const
+			{
+				return m_empty;
+			}
+
+			bool Matches(std::string_view path, bool folder) const
+			{
+				auto slash = path.rfind('/');
+				auto name = slash == std::string_view::npos ? path : path.substr(slash + 1);
+				auto dot = name.rfind('.');
+				auto extension = dot == std::string_view::npos ? std::string_view() : name.substr(dot + 1);
+				for (size_t i = 0; i <= size_t(folder); ++i)
+				{
+					const auto & group = m_groups[i];
+					if (group.names.count(name) || group.paths.count(path) || (dot != std::string_view::npos && group.extensions.count(extension)))
+						return true;
+					if (group.nameGlobs.Matches(name) || group.pathGlobs.Matches(path))
+						return true;
+				}
+				return false;
+			}
+
+		private:
+			struct Group
+			{
+				std::unordered_set<std::string_view> names;
+				std::unordered_set<std::string_view> paths;
+				std::unordered_set<std::string_view> extensions;
+				GlobIndex nameGlobs;
+				GlobIndex pathGlobs;
+			};
+
+			// Patterns matching any entry, then those only matching folders
+			std::array<Group, 2> m_groups;
+			std::deque<std::string> m_text;
+			bool m_empty = true;
+		};
+
+		// Decides which entries of the source folder are combined: files with one of the listed
+		// extensions that match an included pattern, if there are any, and no excluded pattern.
+		// Excluded folders aren't descended into.
+		class SourceSelector
+		{
+		public:
+			explicit SourceSelector(const Params & params)
+			{
+				for (const auto & extension : Tokenize(params.extensions))
+				{
+					auto first = extension.find_first_not_of('.');
+					if (extension == "*")
+						m_anyExtension = true;
+					else if (first != std::string::npos)
+						m_extensions.insert(Lowercase(extension.substr(first)));
+				}
+				m_anyExtension |= m_extensions.empty();
+				for (const auto & pattern : Tokenize(params.included))
+					m_included.Add(pattern);
+				for (const auto & pattern : Tokenize(params.excluded))
+					m_excluded.Add(pattern);
+			}
+
+			bool Selects(std::string_view path, bool folder) const
+			{
+				if (folder)
+					return !m_excluded.Matches(path, true);
+				return HasExtension(path) && Includable(path);
+			}
+
+			// Whether a file would be selected but for its extension, so a quoted include can reach it
+			bool Includable(std::string_view path) const
+			{
+				return (m_included.Empty() || m_included.Matches(path, false)) && !m_excluded.Matches(path, false);
+			}
+
+			bool HasExtension(std::string_view path) const
+			{
+				if (m_anyExtension)
+					return true;
+				auto dot = path.rfind('.');
+				return dot != std::string_view::npos && path.find('/', dot) == std::string_view::npos && m_extensions.count(Lowercase(path.substr(dot + 1)));
+			}
+
+		private:
+			static std::string Lowercase(std::string_view text)
+			{
+				std::string lower(text);
+				for (auto & c : lower)
+					c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+				return lower;
+			}
+
+			std::unordered_set<std::string> m_extensions;
+			bool m_anyExtension = false;
+			PatternSet m_included;
+			PatternSet m_excluded;
+		};
+
+		// Lists the files in the source folder that the selector accepts.  Excluded folders aren't
+		// walked, and other files are never opened.  Files left out only for their extension are
+		// listed separately if asked for, so quoted includes can still reach them.
+		inline_t std::vector<std::string> CollectSourceFiles(const Params & params, FileSystem & fileSystem, std::vector<std::string> * includable = nullptr)
+		{
+			// Files are ordered by the include graph later, starting from files no other file includes
+			// in name order, so the header doesn't depend on the order the file system lists them in
+			SourceSelector selector(params);
+			auto names = fileSystem.Enumerate(params.sourceFolder, params.recursiveScan, [&selector, includable](std::string_view path, bool folder)
+			{
+				return selector.Selects(path, folder) || (includable && !folder && selector.Includable(path));
+			});
+			std::sort(names.begin(), names.end());
+			if (includable)
+			{
+				auto others = std::stable_partition(names.begin(), names.end(), [&selector](const std::string & name)
+				{
+					return selector.HasExtension(name);
+				});
+				includable->assign(std::make_move_iterator(others), std::make_move_iterator(names.end()));
+				names.erase(others, names.end());
+			}
+			return names;
+		}
+
+		// Macros assumed defined or undefined when pruning, including the amalgamation define, or
+		// nothing if no assumptions are given
+		inline_t std::unique_ptr<MacroTable> CreateMacroTable(const Params & params)
+		{
+			if (params.assumeDefined.empty() && params.assumeUndefined.empty())
+				return nullptr;
+			auto macros = std::make_unique<MacroTable>();
+			if (!params.define.empty())
+				macros->Define(params.define, std::nullopt);
+			for (const auto & macro : params.assumeDefined)
+			{
+				// A macro defined without a value is 1, as on a compiler's command line
+				auto equals = macro.find('=');
+				if (equals == std::string::npos)
+					macros->Define(macro, 1);
+				else
+					macros->Define(macro.substr(0, equals), MacroTable::EvaluateBody(std::string_view(macro).substr(equals + 1)));
+			}
+			for (const auto & macro : params.assumeUndefined)
+				macros->Undefine(macro);
+			return macros;
+		}
+
+		inline_t std::string GetInlineMacro(const Params & params)
+		{
+			// All instances of the specified macro are replaced with 'inline' as files are emitted
+			auto first = params.inlined.find_first_not_of(" \t");
+			auto last = params.inlined.find_last_not_of(" \t");
+			return first == std::string::npos ? "inline_t" : params.inlined.substr(first, last - first + 1);
+		}
+
+		inline_t void EmitHeader(Context & context, const Params & params)
+		{
+			// Start from an empty output, so a context can be emitted again after files are reloaded
+			auto & output = context.output;
+			output.Clear();
+			context.flushedBytes = 0;
+			context.includesAttempted = 0;
+			context.includesResolved = 0;
+			context.inlineSubstitutions = 0;
+
+			// Expand includes in place, starting from files that no other file includes
+			BuildIncludeGraph(context);
+			std::vector<uint32_t> includedBy(context.files.Size());
+			for (const auto & includes : context.includes)
+			{
+				for (auto include : includes)
+				{
+					if (include != FileTable::InvalidId)
+						includedBy[include]++;
+				}
+			}
+
+			// Implementation files are deferred to the shards, or to the end of the header behind
+			// the implementation guard
+			bool guarded = !params.implementation.empty() && !context.shards;
+			context.deferring = context.shards || guarded;
+			context.deferred.assign(context.files.Size(), false);
+			context.deferredOrder.clear();
+			context.shardOutputs.clear();
+			if (context.deferring)
+			{
+				for (FileId id = 0; id < context.files.Size(); ++id)
+					context.deferred[id] = IsImplementationFile(context.files.Name(id));
+			}
+			context.macros = CreateMacroTable(params);
+
+			// Hoisted system includes are gathered first, so each can be emitted once ahead of the files.
+			// A single #pragma once replaces those removed from the files.
+			context.hoistIncludes = params.hoistIncludes;
+			HoistCollector collector(context);
+			if (context.hoistIncludes)
+				VisitFiles(context, includedBy, collector);
+			context.hoistedIncludes = collector.includes.size();
+			context.hoistedDirectives = collector.directives;
+
+			// When stripping comments, the leading comments of the first file can be kept at the top
+			context.stripper.reset();
+			if (params.stripComments || params.minify)
+			{
+				context.stripper = std::make_unique<CommentStripper>(params.minify);
+				if (params.keepLicense && context.files.Size())
+				{
+					FileId id = 0;
+					while (id < context.files.Size() && includedBy[id])
+						++id;
+					if (id == context.files.Size())
+						id = 0;
+					auto contents = context.streaming ? ReadForEmission(context, id) : context.sources[id]->contents;
+					auto license = LeadingComments(contents.text);
+					if (!license.empty())
+					{
+						output.AppendCopy(license);
+						output.AppendCopy("\n");
+					}
+				}
+			}
+
+			std::string prologue;
+			if (collector.pragmaOnce)
+				prologue += "\n#pragma once\n";
+
+			// Amalgamation-specific define for header
+			if (!params.define.empty())
+			{
+				prologue += "\n// Amalgamation-specific define";
+				prologue += "\n#ifndef ";
+				prologue += params.define;
+				prologue += "\n#define ";
+				prologue += params.define;
+				prologue += "\n#endif\n";
+			}
+
+			if (!collector.includes.empty())
+				prologue += "\n// Hoisted system includes\n";
+			for (auto include : collector.includes)
+			{
+				prologue += "#include <";
+				prologue += include;
+				prologue += ">\n";
+			}
+			AppendGenerated(context, prologue);
+
+			Emitter emitter(context, output);
+			VisitFiles(context, includedBy, emitter);
+			if (context.macros)
+				*context.macros = *emitter.Macros();
+			if (params.warning)
+			{
+				for (const auto & cycle : context.cycles)
+					params.warning("Include cycle " + cycle);
+			}
+			if (guarded)
+				EmitImplementation(context, params);
+			if (context.stripper)
+			{
+				std::string end;
+				context.stripper->Close(end);
+				output.AppendCopy(end);
+				context.unstrippedBytes = context.stripper->InputBytes();
+			}
+			if (context.streaming)
+				FlushOutput(context);
+			if (context.shards)
+				EmitShards(context, params);
+		}
+
+		inline_t void WriteDepfile(const Context & context, const Params & params)
+		{
+			// Make-format rule naming every file read into the header.  The source folder and the
+			// subfolders walked are listed too, since their timestamps change when files are added
+			// or removed.
+			auto escape = [](std::string_view path)
+			{
+				std::string escaped;
+				for (char c : path)
+				{
+					if (c == ' ' || c == '#')
+						escaped += '\\';
+					else if (c == '$')
+						escaped += '$';
+					escaped += c;
+				}
+				return escaped;
+			};
+			std::string text = escape(std::filesystem::path(params.output).generic_string()) + ":";
+			text += " \\\n  " + escape(std::filesystem::path(params.sourceFolder).generic_string());
+			for (const auto & folder : context.folders)
+				text += " \\\n  " + escape(folder);
+			for (FileId id = 0; id < context.files.Size(); ++id)
+			{
+				if (context.processed[id])
+					text += " \\\n  " + escape(context.files.Name(id));
+			}
+			text += "\n";
+
+			std::ofstream file(params.depfile, std::ios::out | std::ios::binary | std::ios::trunc);
+			file.write(text.data(), text.size());
+			if (!file)
+				throw std::filesystem::filesystem_error("Unable to write depfile", params.depfile, std::make_error_code(std::errc::io_error));
+		}
+
+		inline_t bool WriteHeader(const OutputBuffer & output, const std::string & path)
+		{
+			// Check to see if output folder exists.  If not, create it
+			auto outFolder =  std::filesystem::path(path);
+			outFolder.remove_filename();
+			if (!outFolder.empty() && !std::filesystem::exists(outFolder))
+				std::filesystem::create_directory(outFolder);
+
+			// Leave an identical existing header untouched, so its timestamp doesn't trigger rebuilds.
+			// Otherwise write to a temporary file and rename it into place, so readers never see a
+			// partially written header.
+			if (output.Matches(path))
+				return false;
+			auto tempPath = path + ".tmp";
+			output.Write(tempPath);
+			std::filesystem::rename(tempPath, path);
+			return true;
+		}
+
+		// Write the header and any shards, returning whether any of them changed
+		inline_t bool WriteOutputs(const Context & context, const Params & params)
+		{
+			bool updated = WriteHeader(context.output, params.output);
+			for (size_t shard = 0; shard < context.shardOutputs.size(); ++shard)
+			{
+				if (WriteHeader(context.shardOutputs[shard], ShardPath(params.output, shard).string()))
+					updated = true;
+			}
+			return updated;
+		}
+
+		inline_t bool FilesMatch(const std::filesystem::path & left, const std::filesystem::path & right)
+		{
+			std::error_code ec;
+			if (!std::filesystem::is_regular_file(right, ec) || std::filesystem::file_size(left, ec) != std::filesystem::file_size(right, ec) || ec)
+				return false;
+			std::ifstream leftFile(left, std::ios::binary);
+			std::ifstream rightFile(right, std::ios::binary);
+			std::vector<char> leftBuffer(1 << 16);
+			std::vector<char> rightBuffer(1 << 16);
+			while (leftFile && rightFile)
+			{
+				leftFile.read(leftBuffer.data(), leftBuffer.size());
+				rightFile.read(rightBuffer.data(), rightBuffer.size());
+				if (leftFile.gcount() != rightFile.gcount() || std::memcmp(leftBuffer.data(), rightBuffer.data(), static_cast<size_t>(leftFile.gcount())) != 0)
+					return false;
+			}
+			return leftFile.eof() && rightFile.eof();
+		}
+
+		// Emit the header straight into a temporary file, holding only the files being included, then
+		// rename it into place unless it's identical to the existing header
+		inline_t bool StreamHeader(Context & context, const Params & params)
+		{
+			auto outFolder = std::filesystem::path(params.output);
+			outFolder.remove_filename();
+			if (!outFolder.empty() && !std::filesystem::exists(outFolder))
+				std::filesystem::create_directory(outFolder);
+
+			auto tempPath = params.output + ".tmp";
+#if defined(_WIN32)
+			int fd = _open(tempPath.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+			int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+#endif
+			if (fd < 0)
+				throw std::filesystem::filesystem_error("Unable to create file", tempPath, std::error_code(errno, std::generic_category()));
+			auto closeFile = [](int fd)
+			{
+#if defined(_WIN32)
+				return _close(fd);
+#else
+				return close(fd);
+#endif
+			};
+			FileDescriptorSink sink(fd);
+			context.sink = &sink;
+			try
+			{
+				EmitHeader(context, params);
+			}
+			catch (const std::system_error & e)
+			{
+				context.sink = nullptr;
+				closeFile(fd);
+				throw std::filesystem::filesystem_error("Unable to write file", tempPath, e.code());
+			}
+			catch (...)
+			{
+				context.sink = nullptr;
+				closeFile(fd);
+				throw;
+			}
+			context.sink = nullptr;
+			if (closeFile(fd) != 0)
+				throw std::filesystem::filesystem_error("Unable to write file", tempPath, std::error_code(errno, std::generic_category()));
+
+			if (FilesMatch(tempPath, params.output))
+			{
+				std::filesystem::remove(tempPath);
+				return false;
+			}
+			std::filesystem::rename(tempPath, params.output);
+			return true;
+		}
+
+		// Generated outputs stored in a folder that may be shared between build trees, keyed by a
+		// hash of everything that determines them.  Each entry is a folder holding the header and
+		// any shards, along with the includes that were resolved outside the listed files, and its
+		// modification time records when it was last used, so the least recently used entries can
+		// be removed once the folder grows beyond its size limit.
+		class OutputCache
+		{
+		public:
+			OutputCache(const std::filesystem::path & folder, uintmax_t limit, bool link) :
+				m_folder(folder),
+				m_limit(limit),
+				m_link(link)
+			{
+			}
+
+			// Copy a stored entry into place, or link it if asked to, leaving identical outputs
+			// untouched.  Returns false if there's no complete entry for the key, or the includes
+			// stored with it don't match.  A copy is timestamped now, so build systems see it as
+			// new, while a link shares the stored file with every other tree it was restored into,
+			// so its timestamp is left alone.
+			bool Restore(const std::string & key, const std::vector<std::filesystem::path> & outputs, bool & updated, const std::function<bool(std::string_view includes)> & matches)
+			{
+				auto entry = m_folder / key;
+				std::error_code ec;
+				for (size_t i = 0; i < outputs.size(); ++i)
+				{
+					if (!std::filesystem::is_regular_file(entry / std::to_string(i), ec))
+						return false;
+				}
+				std::ostringstream includes;
+				if (std::filesystem::is_regular_file(entry / "includes", ec))
+					includes << std::ifstream(entry / "includes", std::ios::in | std::ios::binary).rdbuf();
+				if (!matches(includes.str()))
+					return false;
+				updated = false;
+				try
+				{
+					for (size_t i = 0; i < outputs.size(); ++i)
+					{
+						auto stored = entry / std::to_string(i);
+						if (FilesMatch(stored, outputs[i]))
+							continue;
+						auto folder = outputs[i].parent_path();
+						if (!folder.empty())
+							std::filesystem::create_directories(folder);
+						auto tempPath = outputs[i];
+						tempPath += ".tmp";
+						std::filesystem::remove(tempPath, ec);
+						bool linked = false;
+						if (m_link)
+						{
+							std::filesystem::create_hard_link(stored, tempPath, ec);
+							linked = !ec;
+						}
+						if (!linked)
+						{
+							std::filesystem::copy_file(stored, tempPath, std::filesystem::copy_options::overwrite_existing);
+							std::filesystem::last_write_time(tempPath, std::filesystem::file_time_type::clock::now());
+						}
+						std::filesystem::rename(tempPath, outputs[i]);
+						updated = true;
+					}
+				}
+				catch (const std::filesystem::filesystem_error &)
+				{
+					// The entry may have been evicted by another process while being restored
+					return false;
+				}
+				std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), ec);
+				return true;
+			}
+
+			// Copy freshly written outputs into a new entry, then evict old entries if needed.  The
+			// entry is assembled in a temporary folder and renamed into place, so concurrent builds
+			// never see a partial entry.
+			void Store(const std::string & key, const std::vector<std::filesystem::path> & outputs, std::string_view includes)
+			{
+				std::filesystem::create_directories(m_folder);
+				auto entry = m_folder / key;
+				auto tempEntry = m_folder / (key + ".tmp" + std::to_string(std::random_device()()));
+				std::filesystem::create_directory(tempEntry);
+				std::error_code ec;
+				try
+				{
+					for (size_t i = 0; i < outputs.size(); ++i)
+						std::filesystem::copy_file(outputs[i], tempEntry / std::to_string(i));
+					if (!includes.empty())
+					{
+						std::ofstream file(tempEntry / "includes", std::ios::out | std::ios::binary | std::ios::trunc);
+						file.write(includes.data(), includes.size());
+						if (!file)
+							throw std::filesystem::filesystem_error("Unable to write cache entry", tempEntry / "includes", std::make_error_code(std::errc::io_error));
+					}
+					std::filesystem::rename(tempEntry, entry, ec);
+				}
+				catch (...)
+				{
+					std::filesystem::remove_all(tempEntry, ec);
+					throw;
+				}
+				if (ec)
+					std::filesystem::remove_all(tempEntry, ec);
+				Evict(entry);
+			}
+
+		private:
+			// Remove the least recently used entries beyond the size limit, other than the one just stored
+			void Evict(const std::filesystem::path & kept)
+			{
+				struct Entry
+				{
+					std::filesystem::file_time_type used;
+					uintmax_t size;
+					std::filesystem::path path;
+				};
+				std::vector<Entry> entries;
+				uintmax_t total = 0;
+				std::error_code ec;
+				for (const auto & item : std::filesystem::directory_iterator(m_folder, ec))
+				{
+					if (!item.is_directory(ec) || item.path().filename().string().find(".tmp") != std::string::npos)
+						continue;
+					Entry entry = { item.last_write_time(ec), 0, item.path() };
+					for (const auto & file : std::filesystem::directory_iterator(item.path(), ec))
+						entry.size += file.file_size(ec);
+					total += entry.size;
+					entries.push_back(std::move(entry));
+				}
+				std::sort(entries.begin(), entries.end(), [](const auto & left, const auto & right) { return left.used < right.used; });
+				for (const auto & entry : entries)
+				{
+					if (total <= m_limit)
+						break;
+					if (entry.path == kept)
+						continue;
+					std::filesystem::remove_all(entry.path, ec);
+					total -= entry.size;
+				}
+			}
 
-		inline_t std::vector<std::string> Tokenize(const std::string & source)
+			std::filesystem::path m_folder;
+			uintmax_t m_limit;
+			bool m_link;
+		};
+
+		// Key identifying an output by everything that determines it: the parameters affecting the
+		// output, and the name and contents of every input file.  Files are read concurrently, and
+		// kept for emission unless streaming.
+		inline_t std::string HashInputs(Context & context, FileSystem & fileSystem, const Params & params)
 		{
-			if (source.empty())
-				return {};
-			std::regex r(R"(\s+)");
-			std::sregex_token_iterator
-				first{ source.begin(), source.end(), r, -1 },
-				last;
-			return { first, last };
+			std::vector<uint64_t> hashes(context.files.Size());
+			ParallelFor(context.files.Size(), params.jobs, [&](size_t i)
+			{
+				auto id = static_cast<FileId>(i);
+				auto source = CreateSourceFile(context.memory);
+				ReadSourceFile(*source, fileSystem, context.files.Name(id));
+				hashes[id] = HashBytes(source->contents.text);
+				if (!context.streaming)
+					context.sources[id] = std::move(source);
+			});
+
+			std::string inputs = GetVersionString();
+			auto add = [&inputs](std::string_view value)
+			{
+				inputs += value;
+				inputs += '\0';
+			};
+			add(std::filesystem::path(params.output).filename().string());
+			add(context.inlineMacro);
+			add(params.define);
+			add(params.implementation);
+			add(std::to_string(context.shards));
+			add(std::string() + char('0' + params.stripComments) + char('0' + params.minify) + char('0' + params.keepLicense) + char('0' + params.hoistIncludes));
+			for (const auto & macro : params.assumeDefined)
+				add("D" + macro);
+			for (const auto & macro : params.assumeUndefined)
+				add("U" + macro);
+			for (FileId id = 0; id < context.files.Size(); ++id)
+			{
+				add(std::filesystem::path(context.files.Name(id)).lexically_relative(params.sourceFolder).generic_string());
+				inputs.append(reinterpret_cast<const char *>(&hashes[id]), sizeof(uint64_t));
+			}
+
+			std::array<char, 40> key;
+			snprintf(key.data(), key.size(), "%016llx%016llx", static_cast<unsigned long long>(HashBytes(inputs)),
+				static_cast<unsigned long long>(HashBytes(inputs, 0xC2B2AE3D27D4EB4Full)));
+			return key.data();
 		}
 
-		inline_t bool EndsWith(std::string_view str, std::string_view suffix)
+		// List the includes no listed file matched, each with the includable file it was resolved
+		// to and a hash of that file's contents, if it was resolved at all.  Together with the
+		// listed files hashed into the key, this determines the files a header was built from.
+		inline_t std::string DescribeUnlisted(const Context & context, FileSystem & fileSystem, const Params & params)
 		{
-			return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+			std::string text;
+			for (const auto & [include, id] : context.unlisted)
+			{
+				text += include;
+				if (id != FileTable::InvalidId)
+				{
+					const auto & name = context.files.Name(id);
+					std::array<char, 20> hash;
+					snprintf(hash.data(), hash.size(), "%016llx", static_cast<unsigned long long>(HashBytes(fileSystem.Read(name).text)));
+					text += '\t';
+					text += std::filesystem::path(name).lexically_relative(params.sourceFolder).generic_string();
+					text += '\t';
+					text += hash.data();
+				}
+				text += '\n';
+			}
+			return text;
 		}
 
-		inline_t void FindAndReplaceAll(std::string& str, std::string_view search, std::string_view replace)
+		// Check that includes described by DescribeUnlisted still resolve to the same includable
+		// files with the same contents, adding those files to the table so the depfile names them
+		inline_t bool MatchUnlisted(Context & context, FileSystem & fileSystem, const Params & params, std::string_view described)
 		{
-			size_t pos = str.find(search);
-			while (pos != std::string::npos)
+			if (described.empty())
+				return true;
+			FileTable includable(context.includable, context.memory);
+			std::vector<FileId> matched;
+			while (!described.empty())
 			{
-				str.replace(pos, search.size(), replace);
-				pos = str.find(search, pos + search.size());
+				auto end = std::min(described.find('\n'), described.size());
+				auto line = described.substr(0, end);
+				described.remove_prefix(std::min(end + 1, described.size()));
+				auto tab = line.find('\t');
+				auto id = includable.Find(line.substr(0, tab));
+				if (tab == std::string_view::npos || id == FileTable::InvalidId)
+				{
+					if (tab != std::string_view::npos || id != FileTable::InvalidId)
+						return false;
+					continue;
+				}
+				const auto & name = includable.Name(id);
+				std::array<char, 20> hash;
+				snprintf(hash.data(), hash.size(), "%016llx", static_cast<unsigned long long>(HashBytes(fileSystem.Read(name).text)));
+				auto relative = std::filesystem::path(name).lexically_relative(params.sourceFolder).generic_string();
+				if (line.substr(tab + 1) != relative + '\t' + hash.data())
+					return false;
+				matched.push_back(id);
 			}
+			for (auto id : matched)
+			{
+				if (context.files.FindName(includable.Name(id)) == FileTable::InvalidId)
+					context.files.Add(includable.Name(id));
+			}
+			context.sources.resize(context.files.Size());
+			return true;
 		}
-	  
-		inline_t void FindAndProcessLocalIncludes(const std::list<std::filesystem::directory_entry> & dirEntries, const std::string & include, std::set<std::string> & processed, std::string & outputText)
+
+		// The header followed by any shards
+		inline_t std::vector<std::filesystem::path> OutputPaths(const Params & params, unsigned int shards)
 		{
-			// Check to see if we've already processed this file
-			if (processed.find(include) != processed.end())
-				return;
+			std::vector<std::filesystem::path> paths = { params.output };
+			for (size_t shard = 0; shard < shards; ++shard)
+				paths.push_back(ShardPath(params.output, shard));
+			return paths;
+		}
+
+		// Records the wall time of consecutive phases, doing nothing when statistics aren't wanted
+		class PhaseTimer
+		{
+		public:
+			explicit PhaseTimer(Stats * stats) :
+				m_stats(stats)
+			{
+				if (m_stats)
+					m_start = std::chrono::steady_clock::now();
+			}
+
+			void End(const char * name)
+			{
+				if (!m_stats)
+					return;
+				m_stats->phases.push_back({ name, SecondsSince(m_start) });
+				m_start = std::chrono::steady_clock::now();
+			}
 
-			// Find the directory entry that matches this include filename, and if found, process it
-			auto itr = std::find_if(dirEntries.begin(), dirEntries.end(), [include](const auto & entry)
+		private:
+			Stats * m_stats;
+			std::chrono::steady_clock::time_point m_start;
+		};
+
+		inline_t void CollectStats(const Context & context, Stats & stats)
+		{
+			stats.filesFound = context.files.Size();
+			stats.includesAttempted = context.includesAttempted;
+			stats.includesResolved = context.includesResolved;
+			stats.inlineSubstitutions = context.inlineSubstitutions;
+			stats.includeCycles = context.cycles.size();
+			stats.unstrippedBytes = context.unstrippedBytes;
+			stats.systemIncludes = context.hoistedDirectives;
+			stats.hoistedIncludes = context.hoistedIncludes;
+			stats.outputBytes = context.flushedBytes + context.output.Size();
+			for (const auto & shard : context.shardOutputs)
+			{
+				stats.shardBytes.push_back(shard.Size());
+				stats.outputBytes += shard.Size();
+			}
+			for (FileId id = 0; id < context.files.Size(); ++id)
 			{
-				return EndsWith(entry.path().string(), include);
+				const auto & source = context.sources[id];
+				if (!source)
+					continue;
+				auto size = source->size;
+				stats.filesRead++;
+				stats.filesCached += source->cached;
+				stats.filesEmitted += context.processed[id];
+				stats.bytesRead += size;
+				stats.readSeconds += source->readSeconds;
+				stats.lexSeconds += source->lexSeconds;
+				stats.slowestFiles.push_back({ std::string(context.files.Name(id)), size, source->readSeconds + source->lexSeconds });
+			}
+			auto count = std::min(stats.slowestFiles.size(), Stats::SlowestCount);
+			std::partial_sort(stats.slowestFiles.begin(), stats.slowestFiles.begin() + count, stats.slowestFiles.end(), [](const auto & left, const auto & right)
+			{
+				return left.seconds > right.seconds;
 			});
-			if (itr != dirEntries.end())
+			stats.slowestFiles.resize(count);
+		}
+
+		inline_t std::string EscapeJson(std::string_view text)
+		{
+			std::string escaped;
+			for (char c : text)
 			{
-				FindAndProcessLocalIncludes(dirEntries, *itr, processed, outputText);
+				if (c == '"' || c == '\\')
+				{
+					escaped += '\\';
+					escaped += c;
+				}
+				else if (static_cast<unsigned char>(c) < 0x20)
+				{
+					std::array<char, 8> buffer;
+					snprintf(buffer.data(), buffer.size(), "\\u%04x", c);
+					escaped += buffer.data();
+				}
+				else
+					escaped += c;
 			}
+			return escaped;
 		}
 
-		inline_t void FindAndProcessLocalIncludes(const std::list<std::filesystem::directory_entry> & dirEntries, const std::filesystem::directory_entry & dirEntry, std::set<std::string> & processed, std::string & outputText)
+#if defined(__linux__)
+		// Lists a folder tree with openat and getdents64, several folders at a time.  Entry types
+		// come from the folder listing itself, so only symbolic links, and entries on filesystems
+		// that don't report types, cost a stat.  Folders are walked in any order but assembled in
+		// the order directory_iterator would list them, so the output doesn't depend on timing.
+		class FolderWalker
 		{
-			// Check to see if we've already processed this file
-			auto fn = dirEntry.path().filename().string();
-			if (processed.find(fn) != processed.end())
-				return;
+		public:
+			FolderWalker(bool recursive, const FileSystem::EntryFilter & filter, unsigned int jobs) :
+				m_recursive(recursive),
+				m_filter(filter),
+				m_jobs(jobs ? jobs : std::max(1u, std::thread::hardware_concurrency()))
+			{
+			}
+
+			void Walk(const std::string & folder, std::vector<std::string> & names, std::vector<std::string> & folders)
+			{
+				m_folders.push_back({ (std::filesystem::path(folder) / "").generic_string(), nullptr, {}, {} });
+				m_rootLength = m_folders.front().path.size();
+				m_queue.push_back(0);
+				m_outstanding = 1;
+				Work();
+				for (auto & thread : m_threads)
+					thread.join();
+				if (m_error)
+					std::rethrow_exception(m_error);
+
+				// Each subfolder's files take its place in the listing
+				std::vector<std::pair<size_t, size_t>> stack = { { 0, 0 } };
+				while (!stack.empty())
+				{
+					auto & entries = m_folders[stack.back().first].entries;
+					if (stack.back().second == entries.size())
+					{
+						stack.pop_back();
+						continue;
+					}
+					auto & entry = entries[stack.back().second++];
+					if (entry.folder)
+						folders.push_back(std::move(entry.path));
+					else
+						names.push_back(std::move(entry.path));
+					if (entry.listing != NoListing)
+						stack.emplace_back(entry.listing, 0);
+				}
+			}
+
+		private:
+			static constexpr size_t NoListing = ~size_t(0);
+
+			struct Entry
+			{
+				std::string path;
+				bool folder;
+				size_t listing;
+			};
+
+			struct Folder
+			{
+				std::string path;
+				std::shared_ptr<const int> parent;
+				std::string name;
+				std::vector<Entry> entries;
+			};
+
+			void Work()
+			{
+				// The pending stack is taken from the top, so the folders kept open for subfolders that
+				// haven't been listed yet are mostly the ancestors of those being listed
+				std::unique_ptr<uint64_t[]> buffer(new uint64_t[BufferWords]);
+				std::unique_lock<std::mutex> lock(m_mutex);
+				while (true)
+				{
+					++m_waiting;
+					m_wake.wait(lock, [this]() { return !m_queue.empty() || m_outstanding == 0; });
+					--m_waiting;
+					if (m_queue.empty())
+						break;
+					auto & folder = m_folders[m_queue.back()];
+					m_queue.pop_back();
+					lock.unlock();
+
+					std::vector<std::pair<size_t, Folder>> subfolders;
+					std::exception_ptr error;
+					try
+					{
+						List(folder, buffer.get(), subfolders);
+					}
+					catch (...)
+					{
+						error = std::current_exception();
+					}
+
+					lock.lock();
+					if (error && !m_error)
+						m_error = error;
+					if (m_error)
+					{
+						m_outstanding -= m_queue.size();
+						m_queue.clear();
+						subfolders.clear();
+					}
+					for (auto & subfolder : subfolders)
+					{
+						folder.entries[subfolder.first].listing = m_folders.size();
+						m_queue.push_back(m_folders.size());
+						m_folders.push_back(std::move(subfolder.second));
+					}
+					m_outstanding += subfolders.size();
+					--m_outstanding;
+					while (m_queue.size() > m_waiting + 1 && m_threads.size() + 1 < m_jobs)
+						m_threads.emplace_back([this]() { Work(); });
+					if (m_outstanding == 0 || !subfolders.empty())
+						m_wake.notify_all();
+				}
+			}
+
+			void List(Folder & folder, uint64_t * buffer, std::vector<std::pair<size_t, Folder>> & subfolders)
+			{
+				const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+				int fd = folder.parent ? openat(*folder.parent, folder.name.c_str(), flags) : open(folder.path.c_str(), flags);
+				folder.parent.reset();
+				if (fd < 0)
+					throw std::filesystem::filesystem_error("Unable to open folder", folder.path.substr(0, std::max<size_t>(1, folder.path.size() - 1)), std::error_code(errno, std::generic_category()));
+				std::shared_ptr<const int> descriptor(new int(fd), [](const int * fd) { close(*fd); delete fd; });
+
+				while (true)
+				{
+					auto bytes = syscall(SYS_getdents64, fd, buffer, BufferWords * sizeof(uint64_t));
+					if (bytes < 0)
+						throw std::filesystem::filesystem_error("Unable to read folder", folder.path, std::error_code(errno, std::generic_category()));
+					if (bytes == 0)
+						break;
+
+					// Each record is a linux_dirent64: inode, offset, record length, type and name
+					const char * records = reinterpret_cast<const char *>(buffer);
+					for (long pos = 0; pos < bytes;)
+					{
+						const char * record = records + pos;
+						unsigned short length;
+						memcpy(&length, record + 16, sizeof(length));
+						unsigned char type = static_cast<unsigned char>(record[18]);
+						const char * name = record + 19;
+						pos += length;
+						if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+							continue;
+
+						// Symbolic links are listed as what they point to, but not descended into
+						bool isFolder = type == DT_DIR;
+						bool descend = isFolder;
+						if (type == DT_UNKNOWN || type == DT_LNK)
+						{
+							struct stat status;
+							if (type == DT_UNKNOWN && fstatat(fd, name, &status, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISLNK(status.st_mode))
+								descend = isFolder = S_ISDIR(status.st_mode);
+							else
+								isFolder = fstatat(fd, name, &status, 0) == 0 && S_ISDIR(status.st_mode);
+						}
+
+						std::string path = folder.path + name;
+						if (m_filter && !m_filter(std::string_view(path).substr(m_rootLength), isFolder))
+							continue;
+						if (descend && m_recursive)
+							subfolders.emplace_back(folder.entries.size(), Folder{ path + '/', descriptor, name, {} });
+						folder.entries.push_back({ std::move(path), isFolder, NoListing });
+					}
+				}
+			}
+
+			static constexpr size_t BufferWords = 8192;
+
+			bool m_recursive;
+			const FileSystem::EntryFilter & m_filter;
+			unsigned int m_jobs;
+			size_t m_rootLength = 0;
+			std::mutex m_mutex;
+			std::condition_variable m_wake;
+			std::deque<Folder> m_folders;
+			std::vector<size_t> m_queue;
+			size_t m_outstanding = 0;
+			size_t m_waiting = 0;
+			std::vector<std::thread> m_threads;
+			std::exception_ptr m_error;
+		};
+#endif
+
+#if defined(__linux__)
+		// Regenerates a header whenever files in its source folder change.  The file table and
+		// the loaded, lexed files are kept between generations, so a modified file only costs
+		// reloading that file and emitting the output again.
+		class Watcher
+		{
+		public:
+			explicit Watcher(const Params & params) :
+				m_params(params),
+				m_inlineMacro(GetInlineMacro(params)),
+				m_fileSystem(params.jobs),
+				m_selector(params),
+				m_root((std::filesystem::path(params.sourceFolder) / "").generic_string()),
+				m_memory(params.memory ? params.memory : std::pmr::get_default_resource())
+			{
+				m_fd = inotify_init1(IN_CLOEXEC);
+				if (m_fd < 0)
+					throw std::system_error(errno, std::generic_category(), "Unable to initialize inotify");
+
+				// Writing the header must not trigger another generation
+				for (const auto & suffix : { "", ".tmp" })
+				{
+					m_ignored.insert(Normalize(params.output + suffix));
+					for (size_t shard = 0; shard < params.shards; ++shard)
+						m_ignored.insert(Normalize(ShardPath(params.output, shard).string() + suffix));
+				}
+			}
+
+			~Watcher()
+			{
+				close(m_fd);
+			}
+
+			Watcher(const Watcher &) = delete;
+			Watcher & operator = (const Watcher &) = delete;
+
+			// Bring the output up to date with all changes reported by the last wait
+			bool Update()
+			{
+				// A failed update may leave the context partially loaded, so the next one starts over
+				bool rebuild = m_rebuild || !m_context;
+				m_rebuild = true;
+				bool updated = rebuild ? Rebuild() : Reload();
+				m_rebuild = false;
+				m_touched.clear();
+				return updated;
+			}
+
+			// Block until relevant files change, then wait for a short quiet period so that a
+			// burst of saves results in a single update
+			void Wait()
+			{
+				alignas(inotify_event) std::array<char, 64 * 1024> buffer;
+				bool relevant = false;
+				for (;;)
+				{
+					pollfd pfd = { m_fd, POLLIN, 0 };
+					int ready = poll(&pfd, 1, relevant ? DebounceMilliseconds : -1);
+					if (ready < 0 && errno == EINTR)
+						continue;
+					if (ready < 0)
+						throw std::system_error(errno, std::generic_category(), "Unable to wait for file changes");
+					if (ready == 0)
+						return;
+					ssize_t size = read(m_fd, buffer.data(), buffer.size());
+					if (size < 0 && errno == EINTR)
+						continue;
+					if (size < 0)
+						throw std::system_error(errno, std::generic_category(), "Unable to read file changes");
+					for (ssize_t pos = 0; pos < size;)
+					{
+						const auto * event = reinterpret_cast<const inotify_event *>(buffer.data() + pos);
+						pos += sizeof(inotify_event) + event->len;
+						relevant |= Record(*event);
+					}
+				}
+			}
+
+		private:
+			static constexpr int DebounceMilliseconds = 5;
+			static constexpr uint32_t WatchMask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+			static std::string Normalize(const std::filesystem::path & path)
+			{
+				return std::filesystem::absolute(path).lexically_normal().generic_string();
+			}
+
+			bool Record(const inotify_event & event)
+			{
+				if (event.mask & IN_Q_OVERFLOW)
+				{
+					m_rebuild = true;
+					return true;
+				}
+				if (event.mask & IN_IGNORED)
+				{
+					m_watches.erase(event.wd);
+					return false;
+				}
+				auto itr = m_watches.find(event.wd);
+				if (itr == m_watches.end())
+					return false;
+				auto path = event.len ? itr->second / event.name : itr->second;
+				if (m_ignored.count(Normalize(path)))
+					return false;
+
+				// Files that aren't selected, such as editor swap files, don't matter unless they were
+				// reached through an include
+				auto name = path.generic_string();
+				if (event.len && name.compare(0, m_root.size(), m_root) == 0 && !m_selector.Selects(std::string_view(name).substr(m_root.size()), (event.mask & IN_ISDIR) != 0) &&
+					(!m_context || m_context->files.FindName(name) == FileTable::InvalidId))
+					return false;
+
+				// Files appearing or disappearing change the file table, while a completed write
+				// only matters if it's to a file already in the table
+				if (event.mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF))
+					m_rebuild = true;
+				else if (!m_context || m_context->files.FindName(name) == FileTable::InvalidId)
+					return false;
+				m_touched.insert(std::move(name));
+				return true;
+			}
+
+			void AddWatch(const std::filesystem::path & path)
+			{
+				int wd = inotify_add_watch(m_fd, path.c_str(), WatchMask);
+				if (wd < 0)
+					throw std::filesystem::filesystem_error("Unable to watch folder", path, std::error_code(errno, std::generic_category()));
+				m_watches[wd] = path;
+			}
+
+			bool Rebuild()
+			{
+				// Walk the source folder again, watching any folders that are new
+				std::vector<std::string> includable;
+				auto names = CollectSourceFiles(m_params, m_fileSystem, &includable);
+				AddWatch(m_params.sourceFolder);
+				if (m_params.recursiveScan)
+				{
+					for (const auto & folder : m_fileSystem.Folders())
+						AddWatch(folder);
+				}
+
+				// Carry over files from the previous table that haven't been touched since
+				auto context = std::make_unique<Context>(std::move(names), &m_memory);
+				if (m_params.recursiveScan)
+					context->folders = m_fileSystem.Folders();
+				context->includable = std::move(includable);
+				context->inlineMacro = m_inlineMacro;
+				context->shards = m_params.shards;
+				if (m_context)
+				{
+					for (FileId id = 0; id < context->files.Size(); ++id)
+					{
+						auto name = context->files.Name(id);
+						auto previous = m_context->files.FindName(name);
+						if (previous != FileTable::InvalidId && !m_touched.count(name))
+							context->sources[id] = std::move(m_context->sources[previous]);
+					}
+				}
+				m_context = std::move(context);
+				return Generate();
+			}
+
+			bool Reload()
+			{
+				for (const auto & name : m_touched)
+				{
+					auto id = m_context->files.FindName(name);
+					if (id != FileTable::InvalidId)
+						m_context->sources[id] = nullptr;
+				}
+				return Generate();
+			}
+
+			bool Generate()
+			{
+				LoadSourceFiles(*m_context, m_fileSystem, m_params.jobs, nullptr);
+				EmitHeader(*m_context, m_params);
+				bool updated = WriteOutputs(*m_context, m_params);
+				if (!m_params.depfile.empty())
+					WriteDepfile(*m_context, m_params);
+				return updated;
+			}
+
+			Params m_params;
+			std::string m_inlineMacro;
+			DiskFileSystem m_fileSystem;
+			SourceSelector m_selector;
+			std::string m_root;
+			int m_fd = -1;
+			std::unordered_map<int, std::filesystem::path> m_watches;
+			std::unordered_set<std::string> m_ignored;
+			std::unordered_set<std::string> m_touched;
+
+			// Files are carried over between generations, so they're pooled rather than kept in an
+			// arena that would grow with every generation
+			std::pmr::synchronized_pool_resource m_memory;
+			std::unique_ptr<Context> m_context;
+			bool m_rebuild = true;
+		};
+#endif
+	}
+
+	inline_t std::vector<std::string> DiskFileSystem::Enumerate(const std::string & folder, bool recursive, const EntryFilter & filter)
+	{
+		std::vector<std::string> names;
+		m_folders.clear();
+#if defined(__linux__)
+		Detail::FolderWalker(recursive, filter, recursive ? m_jobs : 1).Walk(folder, names, m_folders);
+#else
+		auto root = (std::filesystem::path(folder) / "").generic_string().size();
+		auto walk = [&](auto itr)
+		{
+			for (decltype(itr) end; itr != end; ++itr)
+			{
+				std::error_code ec;
+				auto path = itr->path().generic_string();
+				bool isFolder = itr->is_directory(ec);
+				if (filter && !filter(std::string_view(path).substr(std::min(root, path.size())), isFolder))
+				{
+					if constexpr (std::is_same_v<decltype(itr), std::filesystem::recursive_directory_iterator>)
+						itr.disable_recursion_pending();
+					continue;
+				}
+				if (isFolder)
+					m_folders.push_back(std::move(path));
+				else
+					names.push_back(std::move(path));
+			}
+		};
+		if (recursive)
+			walk(std::filesystem::recursive_directory_iterator(folder));
+		else
+			walk(std::filesystem::directory_iterator(folder));
+#endif
+		return names;
+	}
+
+	inline_t FileContents DiskFileSystem::Read(const std::string & path)
+	{
+		auto buffer = std::make_shared<Detail::FileBuffer>(path);
+		auto text = buffer->View();
+		return { text, std::move(buffer) };
+	}
+
+	inline_t uintmax_t DiskFileSystem::SizeHint(const std::string & path)
+	{
+#if !defined(_WIN32)
+		// Called for every file, so the name isn't converted to a path
+		struct stat status;
+		return stat(path.c_str(), &status) == 0 ? static_cast<uintmax_t>(status.st_size) : 0;
+#else
+		std::error_code ec;
+		auto size = std::filesystem::file_size(path, ec);
+		return ec ? 0 : size;
+#endif
+	}
 
-			// Now mark this file as processed, so we don't add it twice to the combined header
-			processed.emplace(fn);
+	inline_t int64_t DiskFileSystem::ModifiedTime(const std::string & path)
+	{
+		std::error_code ec;
+		return std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+	}
 
-			// Open and read file from dirEntry
-			std::ifstream file(dirEntry.path());
-			std::stringstream buffer;
-			buffer << file.rdbuf();
-			std::string fileData = buffer.str();
+	inline_t void MemoryFileSystem::Add(const std::string & path, std::string contents)
+	{
+		m_files[path] = std::make_shared<const std::string>(std::move(contents));
+	}
 
-			// Mark file beginning
-			outputText += "\n\n// begin --- ";
-			outputText += dirEntry.path().filename().string();
-			outputText += " --- ";
-			outputText += "\n\n";
+	inline_t std::vector<std::string> MemoryFileSystem::Enumerate(const std::string & folder, bool recursive, const EntryFilter & filter)
+	{
+		// Files are listed in path order, so those directly in the folder aren't necessarily first
+		std::string prefix = folder;
+		std::replace(prefix.begin(), prefix.end(), '\\', '/');
+		while (prefix.size() > 1 && prefix.back() == '/')
+			prefix.pop_back();
+		if (prefix == ".")
+			prefix.clear();
+		else if (!prefix.empty() && prefix.back() != '/')
+			prefix += '/';
+		std::vector<std::string> names;
+		for (auto itr = m_files.lower_bound(prefix); itr != m_files.end() && itr->first.compare(0, prefix.size(), prefix) == 0;)
+		{
+			const auto & name = itr->first;
+			if (!recursive && name.find('/', prefix.size()) != std::string::npos)
+			{
+				++itr;
+				continue;
+			}
 
-			// Find local includes
-			std::regex r(R"regex(\s*#\s*include\s*(["])([^"]+)(["]))regex");
-			std::smatch m;
-			std::string s = fileData;
-			while (std::regex_search(s, m, r))
+			// Skip past every file in a subfolder the filter rejects
+			bool rejected = false;
+			for (auto slash = name.find('/', prefix.size()); filter && slash != std::string::npos && !rejected; slash = name.find('/', slash + 1))
 			{
-				// Insert text found up to the include match
-				if (m.prefix().length())
-					outputText += m.prefix().str();
+				if (!filter(std::string_view(name).substr(prefix.size(), slash - prefix.size()), true))
+				{
+					itr = m_files.lower_bound(name.substr(0, slash) + static_cast<char>('/' + 1));
+					rejected = true;
+				}
+			}
+			if (rejected)
+				continue;
+			if (!filter || filter(std::string_view(name).substr(prefix.size()), false))
+				names.push_back(name);
+			++itr;
+		}
+		return names;
+	}
+
+	inline_t FileContents MemoryFileSystem::Read(const std::string & path)
+	{
+		auto itr = m_files.find(path);
+		if (itr == m_files.end())
+			throw std::filesystem::filesystem_error("Unable to open file", path, std::make_error_code(std::errc::no_such_file_or_directory));
+		return { *itr->second, itr->second };
+	}
+
+	inline_t uintmax_t MemoryFileSystem::SizeHint(const std::string & path)
+	{
+		auto itr = m_files.find(path);
+		return itr == m_files.end() ? 0 : itr->second->size();
+	}
+
+	inline_t void StringSink::Write(const std::string_view * pieces, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i)
+			m_text += pieces[i];
+	}
 
-				// Insert the include text into the output stream
-				FindAndProcessLocalIncludes(dirEntries, m[2].str(), processed, outputText);
+	inline_t void CallbackSink::Write(const std::string_view * pieces, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i)
+			m_callback(pieces[i]);
+	}
 
-				// Continue processing the rest of the file text
-				s = m.suffix().str();
+	inline_t void FileDescriptorSink::Write(const std::string_view * pieces, size_t count)
+	{
+#if defined(_WIN32)
+		for (size_t i = 0; i < count; ++i)
+		{
+			auto text = pieces[i];
+			while (!text.empty())
+			{
+				int n = _write(m_fd, text.data(), static_cast<unsigned int>(std::min<size_t>(text.size(), INT_MAX)));
+				if (n < 0)
+					throw std::system_error(errno, std::generic_category(), "Unable to write output");
+				text.remove_prefix(static_cast<size_t>(n));
+			}
+		}
+#else
+		// Gather pieces into iovec batches and hand each batch to a single writev call
+		const size_t batchSize = IOV_MAX < 1024 ? IOV_MAX : 1024;
+		std::vector<iovec> iov;
+		iov.reserve(std::min(batchSize, count));
+		while (count > 0)
+		{
+			iov.clear();
+			for (; count > 0 && iov.size() < batchSize; ++pieces, --count)
+			{
+				if (!pieces->empty())
+					iov.push_back({ const_cast<char *>(pieces->data()), pieces->size() });
 			}
 
-			// Copy remaining file text to output
-			outputText += s;
+			size_t index = 0;
+			while (index < iov.size())
+			{
+				ssize_t n = writev(m_fd, iov.data() + index, static_cast<int>(iov.size() - index));
+				if (n < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					throw std::system_error(errno, std::generic_category(), "Unable to write output");
+				}
 
-			// Mark file end
-			outputText += "\n\n// end --- ";
-			outputText += dirEntry.path().filename().string();
-			outputText += " --- ";
-			outputText += "\n\n";
+				// Skip fully written entries and adjust the first partially written one
+				size_t written = static_cast<size_t>(n);
+				while (index < iov.size() && written >= iov[index].iov_len)
+					written -= iov[index++].iov_len;
+				if (index < iov.size())
+				{
+					iov[index].iov_base = static_cast<char *>(iov[index].iov_base) + written;
+					iov[index].iov_len -= written;
+				}
+			}
 		}
+#endif
 	}
 
 	inline_t std::string GetVersionString()
@@ -128,93 +4248,439 @@ namespace Heady
 		return buffer.data();
 	}
 
-	inline_t void GenerateHeader(const Params& params)
+	inline_t bool GenerateHeader(const Params& params, Stats * stats)
 	{
 		if (params.output.empty())
 			throw std::invalid_argument("Requires a valid output argument");
+		if (stats)
+			*stats = Stats();
+		Detail::PhaseTimer timer(stats);
 
-		// Add initial file entries from designated source folder
-		std::list<std::filesystem::directory_entry> dirEntries;
+		// No need to do anything if we don't have any files to process
+		DiskFileSystem fileSystem(params.jobs);
+		std::vector<std::string> includable;
+		auto names = Detail::CollectSourceFiles(params, fileSystem, &includable);
+		timer.End("walk");
+		if (names.empty())
+			return false;
+
+		// Everything else the run allocates is released at once when it returns.  Shards are
+		// emitted from loaded files, so sharding takes precedence over streaming.
+		Detail::Arena arena(params.memory);
+		Detail::Context context(std::move(names), &arena);
 		if (params.recursiveScan)
+			context.folders = fileSystem.Folders();
+		context.includable = std::move(includable);
+		context.inlineMacro = Detail::GetInlineMacro(params);
+		context.streaming = params.streaming && !params.shards;
+		context.shards = params.shards;
+		context.fileSystem = &fileSystem;
+
+		// Outputs generated from identical inputs are restored from the output cache, skipping
+		// lexing and emission entirely
+		std::unique_ptr<Detail::OutputCache> outputCache;
+		std::string cacheKey;
+		if (!params.cacheDir.empty())
+		{
+			outputCache = std::make_unique<Detail::OutputCache>(params.cacheDir, params.cacheSize, params.cacheLink);
+			cacheKey = Detail::HashInputs(context, fileSystem, params);
+			timer.End("hash");
+			bool updated = false;
+			auto matches = [&](std::string_view includes)
+			{
+				return Detail::MatchUnlisted(context, fileSystem, params, includes);
+			};
+			if (outputCache->Restore(cacheKey, Detail::OutputPaths(params, context.shards), updated, matches))
+			{
+				timer.End("restore");
+				if (!params.depfile.empty())
+				{
+					context.processed.assign(context.files.Size(), true);
+					Detail::WriteDepfile(context, params);
+				}
+				if (stats)
+				{
+					stats->filesFound = context.files.Size();
+					stats->cacheHit = true;
+				}
+				return updated;
+			}
+		}
+
+		// Read and lex all files concurrently, reusing results from the scan cache where possible
+		std::unique_ptr<Detail::ScanCache> scanCache;
+		if (params.scanCache && !context.streaming)
+			scanCache = std::make_unique<Detail::ScanCache>(params.output + ".scancache", context.inlineMacro, &arena);
+		Detail::LoadSourceFiles(context, fileSystem, params.jobs, scanCache.get());
+		timer.End("load");
+
+		// Combine all files and write them to the header if anything changed
+		bool updated = false;
+		if (context.streaming)
+		{
+			updated = Detail::StreamHeader(context, params);
+			timer.End("stream");
+		}
+		else
+		{
+			Detail::EmitHeader(context, params);
+			timer.End("emit");
+			updated = Detail::WriteOutputs(context, params);
+		}
+		if (!params.depfile.empty())
+			Detail::WriteDepfile(context, params);
+		timer.End("write");
+
+		// Update the scan cache for the next run
+		if (scanCache)
+		{
+			scanCache->Save(context.files, context.sources, context.inlineMacro);
+			timer.End("cache");
+		}
+		if (outputCache)
+		{
+			outputCache->Store(cacheKey, Detail::OutputPaths(params, context.shards), Detail::DescribeUnlisted(context, fileSystem, params));
+			timer.End("store");
+		}
+
+		if (stats)
+		{
+			Detail::CollectStats(context, *stats);
+			stats->bytesWritten = updated ? stats->outputBytes : 0;
+		}
+		return updated;
+	}
+
+	inline_t void GenerateHeader(const Params& params, FileSystem & fileSystem, OutputSink & sink, Stats * stats)
+	{
+		if (stats)
+			*stats = Stats();
+		Detail::PhaseTimer timer(stats);
+
+		std::vector<std::string> includable;
+		auto names = Detail::CollectSourceFiles(params, fileSystem, &includable);
+		timer.End("walk");
+		if (names.empty())
+			return;
+
+		Detail::Arena arena(params.memory);
+		Detail::Context context(std::move(names), &arena);
+		context.includable = std::move(includable);
+		context.inlineMacro = Detail::GetInlineMacro(params);
+		context.streaming = params.streaming;
+		context.fileSystem = &fileSystem;
+		Detail::LoadSourceFiles(context, fileSystem, params.jobs, nullptr);
+		timer.End("load");
+
+		// The header is handed to the sink directly from the loaded files, or file by file when streaming
+		if (params.streaming)
 		{
-			for (const auto & f : std::filesystem::recursive_directory_iterator(params.sourceFolder))
-				dirEntries.emplace_back(f);
+			context.sink = &sink;
+			Detail::EmitHeader(context, params);
+			timer.End("stream");
 		}
 		else
 		{
-			for (const auto & f : std::filesystem::directory_iterator(params.sourceFolder))
-				dirEntries.emplace_back(f);
+			Detail::EmitHeader(context, params);
+			timer.End("emit");
+			context.output.Write(sink);
+			timer.End("write");
+		}
+
+		if (stats)
+		{
+			Detail::CollectStats(context, *stats);
+			stats->bytesWritten = stats->outputBytes;
 		}
-		
-		// Create list of excluded filenames
-		auto excludedFilenames = Detail::Tokenize(params.excluded);
+	}
+
+	inline_t std::string FormatStripping(const Stats& stats)
+	{
+		std::array<char, 128> buffer;
+		auto removed = stats.unstrippedBytes > stats.outputBytes ? stats.unstrippedBytes - stats.outputBytes : 0;
+		snprintf(buffer.data(), buffer.size(), "Stripping reduced the header from %llu to %llu bytes (%.1f%% smaller)",
+			static_cast<unsigned long long>(stats.unstrippedBytes), static_cast<unsigned long long>(stats.outputBytes),
+			stats.unstrippedBytes ? 100.0 * removed / stats.unstrippedBytes : 0.0);
+		return buffer.data();
+	}
 
-		// Remove excluded files from fileEntries
-		dirEntries.remove_if([&excludedFilenames](const auto & entry)
+	inline_t std::string FormatStats(const Stats& stats, bool json)
+	{
+		std::string text;
+		std::array<char, 512> buffer;
+		auto append = [&](const char * format, auto... args)
 		{
-			for (auto fn : excludedFilenames)
+			snprintf(buffer.data(), buffer.size(), format, args...);
+			text += buffer.data();
+		};
+		double total = 0.0;
+		for (const auto & phase : stats.phases)
+			total += phase.seconds;
+		if (json)
+		{
+			text += "{\n  \"phases\": [";
+			for (size_t i = 0; i < stats.phases.size(); ++i)
+				append("%s\n    { \"name\": \"%s\", \"seconds\": %.6f }", i ? "," : "", stats.phases[i].name.c_str(), stats.phases[i].seconds);
+			append("\n  ],\n  \"totalSeconds\": %.6f,", total);
+			append("\n  \"readSeconds\": %.6f,\n  \"lexSeconds\": %.6f,", stats.readSeconds, stats.lexSeconds);
+			append("\n  \"filesFound\": %zu,\n  \"filesRead\": %zu,\n  \"filesCached\": %zu,\n  \"filesEmitted\": %zu,", stats.filesFound, stats.filesRead, stats.filesCached, stats.filesEmitted);
+			append("\n  \"cacheHit\": %s,", stats.cacheHit ? "true" : "false");
+			append("\n  \"bytesRead\": %llu,\n  \"outputBytes\": %llu,\n  \"bytesWritten\": %llu,", static_cast<unsigned long long>(stats.bytesRead), static_cast<unsigned long long>(stats.outputBytes), static_cast<unsigned long long>(stats.bytesWritten));
+			append("\n  \"includesAttempted\": %zu,\n  \"includesResolved\": %zu,\n  \"includeCycles\": %zu,\n  \"inlineSubstitutions\": %zu,", stats.includesAttempted, stats.includesResolved, stats.includeCycles, stats.inlineSubstitutions);
+			append("\n  \"systemIncludes\": %zu,\n  \"hoistedIncludes\": %zu,", stats.systemIncludes, stats.hoistedIncludes);
+			append("\n  \"unstrippedBytes\": %llu,", static_cast<unsigned long long>(stats.unstrippedBytes));
+			text += "\n  \"shardBytes\": [";
+			for (size_t i = 0; i < stats.shardBytes.size(); ++i)
+				append("%s%llu", i ? ", " : "", static_cast<unsigned long long>(stats.shardBytes[i]));
+			text += "],";
+			text += "\n  \"slowestFiles\": [";
+			for (size_t i = 0; i < stats.slowestFiles.size(); ++i)
 			{
-				if ((entry.path().filename()) == fn)
-					return true;
+				const auto & file = stats.slowestFiles[i];
+				append("%s\n    { \"path\": \"%s\", \"bytes\": %llu, \"seconds\": %.6f }", i ? "," : "", Detail::EscapeJson(file.path).c_str(), static_cast<unsigned long long>(file.bytes), file.seconds);
 			}
-			return false;
-		});
+			text += "\n  ]\n}\n";
+			return text;
+		}
 
-		// No need to do anything if we don't have any files to process
-		if (dirEntries.empty())
-			return;
+		text += "Phase          Time (ms)\n";
+		for (const auto & phase : stats.phases)
+			append("  %-12s %10.3f\n", phase.name.c_str(), phase.seconds * 1e3);
+		append("  %-12s %10.3f\n", "total", total * 1e3);
+		append("Reading %.3f ms and lexing %.3f ms, summed across threads\n", stats.readSeconds * 1e3, stats.lexSeconds * 1e3);
+		append("Files: %zu found, %zu read, %zu from scan cache, %zu emitted\n", stats.filesFound, stats.filesRead, stats.filesCached, stats.filesEmitted);
+		if (stats.cacheHit)
+			text += "Output restored from the output cache\n";
+		append("Bytes: %llu read, %llu output, %llu written\n", static_cast<unsigned long long>(stats.bytesRead), static_cast<unsigned long long>(stats.outputBytes), static_cast<unsigned long long>(stats.bytesWritten));
+		append("Includes: %zu of %zu resolved, %zu cycles, %zu inline substitutions\n", stats.includesResolved, stats.includesAttempted, stats.includeCycles, stats.inlineSubstitutions);
+		if (stats.systemIncludes)
+			append("System includes: %zu directives hoisted into %zu includes\n", stats.systemIncludes, stats.hoistedIncludes);
+		if (stats.unstrippedBytes)
+			text += FormatStripping(stats) + "\n";
+		if (!stats.shardBytes.empty())
+		{
+			auto [smallest, largest] = std::minmax_element(stats.shardBytes.begin(), stats.shardBytes.end());
+			append("Shards: %zu, from %llu to %llu bytes\n", stats.shardBytes.size(), static_cast<unsigned long long>(*smallest), static_cast<unsigned long long>(*largest));
+		}
+		if (!stats.slowestFiles.empty())
+		{
+			text += "Slowest files to read and lex:\n";
+			for (const auto & file : stats.slowestFiles)
+				append("  %10.3f ms  %10llu bytes  %s\n", file.seconds * 1e3, static_cast<unsigned long long>(file.bytes), file.path.c_str());
+		}
+		return text;
+	}
 
-		// Make sure .cpp files are processed first
-		dirEntries.sort([](const auto & left, const auto & right)
+	inline_t std::vector<bool> GenerateHeaders(const std::vector<Params>& targets, unsigned int jobs)
+	{
+		// Walk each distinct source folder once per selection of files, and create a context for
+		// each header.  Files are shared between headers, so they all use the first target's memory.
+		DiskFileSystem fileSystem(jobs);
+		Detail::Arena arena(targets.empty() ? nullptr : targets.front().memory);
+		struct Listing
 		{
-			// We're taking advantage of the fact that cpp < h or hpp or inc.  If we need to add other
-			// extensions, we'll have to revisit this.
-			return left.path().extension() < right.path().extension();
-		});
+			std::vector<std::string> names;
+			std::vector<std::string> includable;
+			std::vector<std::string> folders;
+		};
+		std::map<std::tuple<std::string, bool, std::string, std::string, std::string>, Listing> listings;
+		std::vector<std::unique_ptr<Detail::Context>> contexts;
+		for (const auto & params : targets)
+		{
+			if (params.output.empty())
+				throw std::invalid_argument("Requires a valid output argument");
+			auto key = std::make_tuple(std::filesystem::absolute(params.sourceFolder).lexically_normal().string(), params.recursiveScan, params.excluded, params.included, params.extensions);
+			auto itr = listings.find(key);
+			if (itr == listings.end())
+			{
+				Listing listing;
+				listing.names = Detail::CollectSourceFiles(params, fileSystem, &listing.includable);
+				listing.folders = fileSystem.Folders();
+				itr = listings.emplace(key, std::move(listing)).first;
+			}
+			contexts.push_back(std::make_unique<Detail::Context>(itr->second.names, &arena));
+			if (params.recursiveScan)
+				contexts.back()->folders = itr->second.folders;
+			contexts.back()->includable = itr->second.includable;
+			contexts.back()->inlineMacro = Detail::GetInlineMacro(params);
+			contexts.back()->streaming = params.streaming && !params.shards;
+			contexts.back()->shards = params.shards;
+			contexts.back()->fileSystem = &fileSystem;
+		}
 
-		// Amalgamation-specific define for header
-		std::string outputText;
-		if (!params.define.empty())
+		// Load and lex every distinct file once, sharing it between all headers that use it.  Lexing
+		// depends on the inline macro, and streamed headers release their files after lexing, so both
+		// are part of what makes a file distinct.
+		std::unordered_map<std::string, std::shared_ptr<Detail::SourceFile>> shared;
+		std::vector<std::pair<uintmax_t, std::pair<Detail::Context *, Detail::FileId>>> order;
+		for (auto & context : contexts)
 		{
-			outputText += "\n// Amalgamation-specific define";
-			outputText += "\n#ifndef ";
-			outputText += params.define;
-			outputText += "\n#define ";
-			outputText += params.define;
-			outputText += "\n#endif\n";
+			for (Detail::FileId id = 0; id < context->files.Size(); ++id)
+			{
+				const auto & name = context->files.Name(id);
+				auto key = std::filesystem::absolute(name).lexically_normal().string();
+				key += '\0';
+				key += context->inlineMacro;
+				key += context->streaming ? '\1' : '\0';
+				auto & source = shared[key];
+				if (!source)
+				{
+					source = Detail::CreateSourceFile(&arena);
+					order.emplace_back(fileSystem.SizeHint(name), std::make_pair(context.get(), id));
+				}
+				context->sources[id] = source;
+			}
 		}
+		Detail::SortLargestFirst(order);
+		Detail::ParallelFor(order.size(), jobs, [&](size_t i)
+		{
+			auto [context, id] = order[i].second;
+			Detail::LoadSourceFile(*context->sources[id], fileSystem, context->files.Name(id), context->inlineMacro, nullptr);
+			if (context->streaming)
+				Detail::ReleaseContents(*context->sources[id]);
+		});
 
-		// Recursively combine all source and headers into a single output string
-		std::set<std::string> processed;
-		for (const auto & entry : dirEntries)
-			Detail::FindAndProcessLocalIncludes(dirEntries, entry, processed, outputText);
+		// Files reached only through includes are loaded for each header that reaches them
+		for (auto & context : contexts)
+			Detail::LoadSourceFiles(*context, fileSystem, jobs, nullptr);
+
+		// Emit and write independent headers concurrently
+		std::vector<char> updated(targets.size(), false);
+		Detail::ParallelFor(targets.size(), jobs, [&](size_t i)
+		{
+			if (contexts[i]->files.Size() == 0)
+				return;
+			if (contexts[i]->streaming)
+				updated[i] = Detail::StreamHeader(*contexts[i], targets[i]);
+			else
+			{
+				Detail::EmitHeader(*contexts[i], targets[i]);
+				updated[i] = Detail::WriteOutputs(*contexts[i], targets[i]);
+			}
+			if (!targets[i].depfile.empty())
+				Detail::WriteDepfile(*contexts[i], targets[i]);
+		});
+		return std::vector<bool>(updated.begin(), updated.end());
+	}
 
-		// Replace all instances of a specified macro with 'inline'
-		std::string inlineValue = params.inlined;
-		if (inlineValue.empty())
-			inlineValue = "inline_t ";
-		if (inlineValue[inlineValue.size() - 1] != ' ')
-			inlineValue += " ";
-		Detail::FindAndReplaceAll(outputText, inlineValue, "inline ");
+	inline_t std::vector<Params> ReadManifest(const std::string & path)
+	{
+		// Each section names an output header, followed by key = value lines setting its
+		// parameters.  Relative paths are relative to the manifest's folder.
+		std::ifstream file(path);
+		if (!file)
+			throw std::invalid_argument("Unable to open manifest " + path);
+		auto folder = std::filesystem::path(path).parent_path();
+		auto resolve = [&folder](const std::string & value)
+		{
+			return (folder / value).lexically_normal().string();
+		};
+		auto trim = [](const std::string & value)
+		{
+			auto first = value.find_first_not_of(" \t\r");
+			auto last = value.find_last_not_of(" \t\r");
+			return first == std::string::npos ? std::string() : value.substr(first, last - first + 1);
+		};
 
-		// Check to see if output folder exists.  If not, create it
-		auto outFolder =  std::filesystem::path(params.output);
-		outFolder.remove_filename();
-		if (!std::filesystem::exists(outFolder))
+		std::vector<Params> targets;
+		std::string line;
+		for (size_t lineNumber = 1; std::getline(file, line); ++lineNumber)
 		{
-			std::filesystem::create_directory(outFolder);
+			line = trim(line);
+			if (line.empty() || line[0] == '#' || line[0] == ';')
+				continue;
+			auto error = [&](const std::string & message)
+			{
+				return std::invalid_argument(path + "(" + std::to_string(lineNumber) + "): " + message);
+			};
+			if (line.front() == '[' && line.back() == ']')
+			{
+				targets.emplace_back();
+				targets.back().output = resolve(trim(line.substr(1, line.size() - 2)));
+				targets.back().recursiveScan = false;
+				continue;
+			}
+			auto equals = line.find('=');
+			if (equals == std::string::npos)
+				throw error("Expected key = value");
+			if (targets.empty())
+				throw error("Expected [output] section before parameters");
+			auto key = trim(line.substr(0, equals));
+			auto value = trim(line.substr(equals + 1));
+			auto & params = targets.back();
+			if (key == "source")
+				params.sourceFolder = resolve(value);
+			else if (key == "excluded")
+				params.excluded = value;
+			else if (key == "included")
+				params.included = value;
+			else if (key == "extensions")
+				params.extensions = value;
+			else if (key == "inline")
+				params.inlined = value;
+			else if (key == "define")
+				params.define = value;
+			else if (key == "depfile")
+				params.depfile = resolve(value);
+			else if (key == "recursive")
+				params.recursiveScan = value == "true" || value == "1" || value == "yes";
+			else if (key == "strip-comments")
+				params.stripComments = value == "true" || value == "1" || value == "yes";
+			else if (key == "minify")
+				params.minify = value == "true" || value == "1" || value == "yes";
+			else if (key == "keep-license")
+				params.keepLicense = value == "true" || value == "1" || value == "yes";
+			else if (key == "hoist")
+				params.hoistIncludes = value == "true" || value == "1" || value == "yes";
+			else if (key == "stream")
+				params.streaming = value == "true" || value == "1" || value == "yes";
+			else if (key == "assume-defined")
+				params.assumeDefined = Detail::Tokenize(value);
+			else if (key == "assume-undefined")
+				params.assumeUndefined = Detail::Tokenize(value);
+			else if (key == "implementation")
+				params.implementation = value;
+			else if (key == "shards")
+			{
+				if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || value.size() > 9)
+					throw error("Expected a number of shards");
+				params.shards = static_cast<unsigned int>(std::stoul(value));
+			}
+			else
+				throw error("Unknown key '" + key + "'");
 		}
-		else
+		for (const auto & params : targets)
 		{
-			// Remove existing file
-			if (std::filesystem::exists(params.output))
-				std::filesystem::remove(params.output);
+			if (params.sourceFolder.empty())
+				throw std::invalid_argument(path + ": no source folder given for " + params.output);
 		}
+		return targets;
+	}
 
-		// Write all processed file data to new header file
-		std::ofstream outFile;
-		outFile.open(params.output, std::ios::out);
-		outFile << outputText;
+	inline_t void WatchHeader(const Params& params, const std::function<void(bool updated, const std::exception * error)> & callback)
+	{
+		if (params.output.empty())
+			throw std::invalid_argument("Requires a valid output argument");
+#if defined(__linux__)
+		Detail::Watcher watcher(params);
+		for (;;)
+		{
+			try
+			{
+				callback(watcher.Update(), nullptr);
+			}
+			catch (const std::exception & e)
+			{
+				// Files may be caught in the middle of being saved, so report the error and
+				// try again on the next change
+				callback(false, &e);
+			}
+			watcher.Wait();
+		}
+#else
+		(void)callback;
+		throw std::runtime_error("Watch mode requires inotify, which is only available on Linux");
+#endif
 	}
 	
 }
\ No newline at end of file
@@ -24,7 +24,15 @@ THE SOFTWARE.
 
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <functional>
+#include <exception>
 
 #define inline_t
 
@@ -46,13 +54,209 @@ namespace Heady
 	{
 		std::string sourceFolder;
 		std::string output;
-		std::string excluded;
+		std::string excluded; // Names or glob patterns of files and folders to leave out
+		std::string included; // Glob patterns of files to combine, or empty for every file that isn't excluded
+		std::string extensions = "h hh hpp hxx h++ inl inc ipp tpp tcc txx c cc cpp cxx c++"; // Extensions of files to combine, or "*" for any file
 		std::string inlined;
 		std::string define;
-		bool recursiveScan;
+		std::string depfile; // Optional Make-format dependency file listing every file read
+		bool recursiveScan = false;
+		unsigned int jobs = 0; // Threads used to read and scan files, or zero for one per core
+		bool scanCache = false; // Reuse lexing results stored next to the output from the previous run
+		bool stripComments = false; // Remove comments and blank lines
+		bool minify = false; // Remove comments and collapse whitespace, keeping line breaks only after directives
+		bool keepLicense = false; // Keep the leading comments of the first file when stripping comments
+		bool hoistIncludes = false; // Emit each system include once ahead of the files, and drop #pragma once from them
+		bool streaming = false; // Emit files one at a time, releasing each, so memory is bounded by the files on the deepest include chain (ignores scanCache)
+		std::vector<std::string> assumeDefined; // Macros assumed defined, as NAME or NAME=VALUE, for dropping #if branches that are decided by them
+		std::vector<std::string> assumeUndefined; // Macros assumed undefined, for dropping #if branches that are decided by them
+		std::string implementation; // Define guarding implementation files at the end of the header, STB-style, or empty to inline them
+		unsigned int shards = 0; // Split implementation files into this many translation units next to the output, or zero for none (ignores streaming and implementation)
+		std::string cacheDir; // Folder storing outputs by a hash of their inputs, shared between build trees, or empty for none
+		uintmax_t cacheSize = 1024ull * 1024 * 1024; // Size beyond which the least recently used outputs are removed from cacheDir
+		bool cacheLink = false; // Restore outputs from cacheDir as hard links to the stored files rather than copies, keeping their timestamps
+		std::pmr::memory_resource * memory = nullptr; // Supplies the blocks of the arena each run allocates from, or null for the default resource
+		std::function<void(const std::string &)> warning; // Receives warnings such as include cycles, if set
 	};
 
-	/// Generate combined header from source
-	void GenerateHeader(const Params& params);
+	/// Timing and counters collected while generating a header
+	struct Stats
+	{
+		struct Phase
+		{
+			std::string name;
+			double seconds;
+		};
+
+		struct File
+		{
+			std::string path;
+			uintmax_t bytes;
+			double seconds;
+		};
+
+		/// Number of files reported in slowestFiles
+		static constexpr size_t SlowestCount = 10;
+
+		std::vector<Phase> phases;
+		double readSeconds = 0.0;
+		double lexSeconds = 0.0;
+		size_t filesFound = 0;
+		size_t filesRead = 0;
+		size_t filesCached = 0;
+		size_t filesEmitted = 0;
+		bool cacheHit = false;
+		uintmax_t bytesRead = 0;
+		uintmax_t outputBytes = 0;
+		uintmax_t bytesWritten = 0;
+		size_t includesAttempted = 0;
+		size_t includesResolved = 0;
+		size_t includeCycles = 0;
+		size_t systemIncludes = 0;
+		size_t hoistedIncludes = 0;
+		uintmax_t unstrippedBytes = 0;
+		size_t inlineSubstitutions = 0;
+		std::vector<uintmax_t> shardBytes;
+		std::vector<File> slowestFiles;
+	};
+
+	/// Contents of a file read through a FileSystem.  The text remains valid for as long as
+	/// the owner is held, and the owner may be empty if the text outlives the generation.
+	struct FileContents
+	{
+		std::string_view text;
+		std::shared_ptr<const void> owner;
+	};
+
+	/// Source of the files combined into a header
+	class FileSystem
+	{
+	public:
+		virtual ~FileSystem() = default;
+
+		/// Decides whether a file is listed, or a folder descended into, given its path relative
+		/// to the folder being enumerated.  Called concurrently from several threads.
+		using EntryFilter = std::function<bool(std::string_view path, bool folder)>;
+
+		/// List the files in a folder, and in its subfolders if recursive, using '/' as a separator.
+		/// An empty filter lists every file.
+		virtual std::vector<std::string> Enumerate(const std::string & folder, bool recursive, const EntryFilter & filter) = 0;
+
+		/// Read a file returned by Enumerate.  Called concurrently from several threads.
+		virtual FileContents Read(const std::string & path) = 0;
+
+		/// Approximate size of a file, used to start reading the largest files first
+		virtual uintmax_t SizeHint(const std::string &) { return 0; }
+
+		/// Modification time of a file, used to validate the scan cache, or zero if unknown
+		virtual int64_t ModifiedTime(const std::string &) { return 0; }
+	};
+
+	/// Reads files from disk, memory-mapping them where possible
+	class DiskFileSystem : public FileSystem
+	{
+	public:
+		/// Subfolders are walked on up to the given number of threads, or one per core if zero
+		explicit DiskFileSystem(unsigned int jobs = 0) : m_jobs(jobs) {}
+
+		std::vector<std::string> Enumerate(const std::string & folder, bool recursive, const EntryFilter & filter) override;
+		FileContents Read(const std::string & path) override;
+		uintmax_t SizeHint(const std::string & path) override;
+		int64_t ModifiedTime(const std::string & path) override;
+
+		/// Subfolders found by the last call to Enumerate
+		const std::vector<std::string> & Folders() const { return m_folders; }
+
+	private:
+		unsigned int m_jobs;
+		std::vector<std::string> m_folders;
+	};
+
+	/// Serves files held in memory, such as sources generated by a build tool
+	class MemoryFileSystem : public FileSystem
+	{
+	public:
+		/// Add or replace a file.  Text already read from a replaced file remains valid.
+		void Add(const std::string & path, std::string contents);
+
+		std::vector<std::string> Enumerate(const std::string & folder, bool recursive, const EntryFilter & filter) override;
+		FileContents Read(const std::string & path) override;
+		uintmax_t SizeHint(const std::string & path) override;
+
+	private:
+		std::map<std::string, std::shared_ptr<const std::string>, std::less<>> m_files;
+	};
+
+	/// Destination of a generated header, which is written as a sequence of pieces
+	class OutputSink
+	{
+	public:
+		virtual ~OutputSink() = default;
+
+		/// Write the next pieces of the header, in order
+		virtual void Write(const std::string_view * pieces, size_t count) = 0;
+	};
+
+	/// Appends the header to a string
+	class StringSink : public OutputSink
+	{
+	public:
+		explicit StringSink(std::string & text) : m_text(text) {}
+		void Write(const std::string_view * pieces, size_t count) override;
+
+	private:
+		std::string & m_text;
+	};
+
+	/// Passes each piece of the header to a callback
+	class CallbackSink : public OutputSink
+	{
+	public:
+		explicit CallbackSink(std::function<void(std::string_view)> callback) : m_callback(std::move(callback)) {}
+		void Write(const std::string_view * pieces, size_t count) override;
+
+	private:
+		std::function<void(std::string_view)> m_callback;
+	};
+
+	/// Writes the header to an open file descriptor, such as a pipe or stdout, which remains open
+	class FileDescriptorSink : public OutputSink
+	{
+	public:
+		explicit FileDescriptorSink(int fd) : m_fd(fd) {}
+		void Write(const std::string_view * pieces, size_t count) override;
+
+	private:
+		int m_fd;
+	};
+
+	/// Generate combined header from source.  Returns false if an identical header already existed.
+	/// Timing and counters are collected into stats if given.  Only this overload uses cacheDir.
+	bool GenerateHeader(const Params& params, Stats * stats = nullptr);
+
+	/// Generate combined header from files read through the given file system, writing it to the
+	/// sink rather than to params.output.  The output, depfile, scanCache and shards parameters are ignored.
+	void GenerateHeader(const Params& params, FileSystem & fileSystem, OutputSink & sink, Stats * stats = nullptr);
+
+	/// Describe the size reduction achieved by stripping comments or minifying
+	std::string FormatStripping(const Stats& stats);
+
+	/// Format statistics as a readable report, or as JSON
+	std::string FormatStats(const Stats& stats, bool json = false);
+
+	/// Generate several headers in one process.  Source folders are walked once and files are
+	/// loaded once, no matter how many headers use them, and headers are generated concurrently
+	/// on up to the given number of threads (zero for one per core).  Returns whether each
+	/// header was updated.
+	std::vector<bool> GenerateHeaders(const std::vector<Params>& targets, unsigned int jobs = 0);
+
+	/// Read a list of headers to generate from a manifest file
+	std::vector<Params> ReadManifest(const std::string & path);
+
+	/// Generate the header, then regenerate it whenever files in the source folder change.  The
+	/// callback is invoked after each generation with whether the header was updated, or with
+	/// the error that prevented it.  Only supported on Linux, and does not return unless the
+	/// source folder can't be watched.
+	void WatchHeader(const Params& params, const std::function<void(bool updated, const std::exception * error)> & callback);
 
 }
@@ -8,6 +8,7 @@ Copyright (c) 2018 James Boer
 #include <iostream>
 #include <thread>
 #include <cstring>
+#include <fstream>
 #include "clara.hpp"
 #include "Heady.h"
 
@@ -18,18 +19,60 @@ int main(int argc, char ** argv)
 	// Handle command-line options
 	std::string source;
 	std::string excluded;
+	std::string included;
+	std::string extensions = Heady::Params().extensions;
 	std::string inlined = "inline_t";
 	std::string define;
 	std::string output;
+	std::string manifest;
+	std::string depfile;
+	std::string statsJson;
+	bool showStats = false;
 	bool recursive = false;
+	unsigned int jobs = 0;
+	bool scanCache = false;
+	std::string cacheDir;
+	unsigned int cacheSize = 1024;
+	bool cacheLink = false;
+	bool streaming = false;
+	std::vector<std::string> assumeDefined;
+	std::vector<std::string> assumeUndefined;
+	std::string implementation;
+	unsigned int shards = 0;
+	bool hoistIncludes = false;
+	bool stripComments = false;
+	bool minify = false;
+	bool keepLicense = false;
+	bool watch = false;
 	bool showHelp = false;
 	auto parser = 
 		Opt(source, "folder")["-s"]["--source"]("folder containing source files") |
-		Opt(excluded, "files")["-e"]["--excluded"]("exclude specific files") |
+		Opt(excluded, "patterns")["-e"]["--excluded"]("exclude files and folders matching these names or patterns") |
+		Opt(included, "patterns")["--included"]("only include files matching these patterns") |
+		Opt(extensions, "extensions")["--extensions"]("extensions of files to include, or * for any (default: C and C++ sources and headers)") |
 		Opt(inlined, "name")["-i"]["--inline"]("inline macro substitution") |
 		Opt(define, "define")["-d"]["--define"]("define for almagamated header") |
 		Opt(output, "file")["-o"]["--output"]("generated header file") |
+		Opt(manifest, "file")["-m"]["--manifest"]("generate every header listed in a manifest file") |
+		Opt(depfile, "file")["--depfile"]("write a Make-format dependency file for the header") |
+		Opt(showStats)["--stats"]("report time spent in each phase along with file and byte counts") |
+		Opt(statsJson, "file")["--stats-json"]("write statistics to a JSON file") |
 		Opt(recursive)["-r"]["--recursive"]("recursively scan source folder") |
+		Opt(jobs, "count")["-j"]["--jobs"]("threads used to read and scan files (default: one per core)") |
+		Opt(scanCache)["--scan-cache"]("reuse scan results of unchanged files from the previous run") |
+		Opt(cacheDir, "folder")["--cache-dir"]("restore identical outputs from, and store new ones in, a folder shared between builds") |
+		Opt(cacheSize, "megabytes")["--cache-size"]("size limit of the cache folder (default: 1024)") |
+		Opt(cacheLink)["--cache-link"]("restore outputs from the cache folder as hard links instead of copies") |
+		Opt(stripComments)["--strip-comments"]("remove comments and blank lines") |
+		Opt(minify)["--minify"]("remove comments and collapse whitespace") |
+		Opt(keepLicense)["--keep-license"]("keep the first file's leading comments when stripping") |
+		Opt(hoistIncludes)["--hoist-includes"]("emit each system include once at the top, dropping #pragma once") |
+		Opt(streaming)["--stream"]("emit files one at a time to bound memory use") |
+		Opt(assumeDefined, "macro[=value]")["-D"]["--assume-defined"]("drop #if branches ruled out by this macro being defined") |
+		Opt(assumeUndefined, "macro")["-U"]["--assume-undefined"]("drop #if branches ruled out by this macro being undefined") |
+		Opt(implementation, "define")["--implementation"]("place implementation files at the end, compiled only where the define is set") |
+		Opt(shards, "count")["--shards"]("split implementation files into this many source files next to the header") |
+		Opt(watch)["-w"]["--watch"]("regenerate the header whenever source files change") |
 		Help(showHelp)
 		;
 
@@ -48,7 +91,7 @@ int main(int argc, char ** argv)
 			"\nHeady --source \"Source\" --exluded \"Main.cpp clara.hpp\" --inline \"inline_t\" --output \"Include/Heady.hpp\"\n";
 		return 0;
 	}
-	else if (source.empty() || output.empty())
+	else if ((source.empty() || output.empty()) && manifest.empty())
 	{
 		std::cerr << "Error: Valid source and output are required.\n\n";
 		parser.writeToStream(std::cerr);
@@ -61,14 +104,82 @@ int main(int argc, char ** argv)
 	// Generate a combined header file from all C++ source files
 	try
 	{
+		auto warning = [](const std::string & message)
+		{
+			std::cerr << "Warning: " + message + "\n";
+		};
+		if (!manifest.empty())
+		{
+			auto targets = Heady::ReadManifest(manifest);
+			for (auto & target : targets)
+				target.warning = warning;
+			auto updated = Heady::GenerateHeaders(targets, jobs);
+			for (size_t i = 0; i < targets.size(); ++i)
+			{
+				if (updated[i])
+					std::cout << "Updated " << targets[i].output << "\n";
+				else
+					std::cout << targets[i].output << " is up to date\n";
+			}
+			return 0;
+		}
+
 		Heady::Params params;
 		params.sourceFolder = source;
 		params.output = output;
 		params.excluded = excluded;
+		params.included = included;
+		params.extensions = extensions;
 		params.inlined = inlined;
 		params.define = define;
+		params.depfile = depfile;
 		params.recursiveScan = recursive;
-		Heady::GenerateHeader(params);
+		params.jobs = jobs;
+		params.scanCache = scanCache;
+		params.cacheDir = cacheDir;
+		params.cacheSize = static_cast<uintmax_t>(cacheSize) << 20;
+		params.cacheLink = cacheLink;
+		params.streaming = streaming;
+		params.assumeDefined = assumeDefined;
+		params.assumeUndefined = assumeUndefined;
+		params.implementation = implementation;
+		params.shards = shards;
+		params.hoistIncludes = hoistIncludes;
+		params.stripComments = stripComments;
+		params.minify = minify;
+		params.keepLicense = keepLicense;
+		params.warning = warning;
+		if (watch)
+		{
+			Heady::WatchHeader(params, [&output](bool updated, const std::exception * error)
+			{
+				if (error)
+					std::cerr << "Error processing source files.  " << error->what() << std::endl;
+				else if (updated)
+					std::cout << "Updated " << output << std::endl;
+				else
+					std::cout << output << " is up to date" << std::endl;
+			});
+		}
+		else
+		{
+			Heady::Stats stats;
+			if (Heady::GenerateHeader(params, &stats))
+				std::cout << "Updated " << output << "\n";
+			else
+				std::cout << output << " is up to date\n";
+			if (stats.unstrippedBytes && !showStats)
+				std::cout << Heady::FormatStripping(stats) << "\n";
+			if (showStats)
+				std::cout << Heady::FormatStats(stats);
+			if (!statsJson.empty())
+			{
+				std::ofstream file(statsJson);
+				file << Heady::FormatStats(stats, true);
+				if (!file)
+					throw std::runtime_error("Unable to write " + statsJson);
+			}
+		}
 	}
 	catch (const std::exception & e)
 	{
@@ -0,0 +1,91 @@
+/*
+The Heady library is distributed under the MIT License (MIT)
+https://opensource.org/licenses/MIT
+See LICENSE.TXT or Heady.h for license details.
+Copyright (c) 2018 James Boer
+*/
+
+#include "Generator.h"
+
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace Bench
+{
+	namespace
+	{
+		const char * License =
+			"/*\n"
+			"Generated by HeadyBench.  This block stands in for the license comment found at\n"
+			"the top of most source files, so comment handling is part of every measurement.\n"
+			"*/\n\n";
+
+		std::string FileName(size_t index, size_t level)
+		{
+			// Files at the top level are translation units, everything below them is a header
+			return (level == 0 ? "Unit" : "Header") + std::to_string(index) + (level == 0 ? ".cpp" : ".h");
+		}
+	}
+
+	TreeInfo GenerateTree(const std::filesystem::path & folder, const TreeParams & params)
+	{
+		std::filesystem::remove_all(folder);
+		std::filesystem::create_directories(folder);
+
+		// Raw engine output is used rather than the standard distributions, whose results
+		// differ between standard library implementations
+		std::mt19937 random(params.seed);
+		auto next = [&random](size_t range) { return range ? static_cast<size_t>(random() % range) : 0; };
+
+		// Files are split evenly into levels, and only include files on deeper levels, so the
+		// include graph is acyclic and its longest chain is the requested depth
+		size_t depth = std::max<size_t>(1, std::min(params.depth, params.files));
+		auto levelOf = [&](size_t index) { return index * depth / std::max<size_t>(1, params.files); };
+		auto firstOnLevel = [&](size_t level) { return (level * params.files + depth - 1) / depth; };
+
+		TreeInfo info;
+		std::string text;
+		for (size_t index = 0; index < params.files; ++index)
+		{
+			size_t level = levelOf(index);
+			text.clear();
+			text += License;
+			if (level > 0)
+				text += "#pragma once\n\n";
+			text += "#include <vector>\n#include <string>\n";
+
+			if (level + 1 < depth)
+			{
+				size_t first = firstOnLevel(level + 1);
+				for (size_t i = 0; i < params.fanOut; ++i)
+				{
+					size_t target = first + next(params.files - first);
+					text += "#include \"" + FileName(target, levelOf(target)) + "\"\n";
+				}
+			}
+			text += "\nnamespace Generated\n{\n";
+
+			// Fill the file with a mix of comments, functions and string literals
+			for (size_t line = 0; text.size() < params.fileSize; ++line)
+			{
+				auto id = std::to_string(index) + "_" + std::to_string(line);
+				if (static_cast<double>(next(1000)) < params.commentDensity * 1000.0)
+					text += "\t// Comment " + id + " mentioning inline_t and #include \"Missing.h\"\n";
+				else if (line % 4 == 3)
+					text += "\tinline_t const char * Name" + id + "() { return \"Name " + id + " // not a comment\"; }\n";
+				else
+					text += "\tinline_t int Function" + id + "(int value) { return value * " + std::to_string(line + 1) + " + " + std::to_string(index) + "; }\n";
+			}
+			text += "}\n";
+
+			std::ofstream file(folder / FileName(index, level), std::ios::out | std::ios::binary);
+			file.write(text.data(), static_cast<std::streamsize>(text.size()));
+			info.files++;
+			info.bytes += text.size();
+		}
+		return info;
+	}
+}
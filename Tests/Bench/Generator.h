@@ -0,0 +1,34 @@
+/*
+The Heady library is distributed under the MIT License (MIT)
+https://opensource.org/licenses/MIT
+See LICENSE.TXT or Heady.h for license details.
+Copyright (c) 2018 James Boer
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+namespace Bench
+{
+	// Shape of a synthetic source tree
+	struct TreeParams
+	{
+		size_t files = 1000;
+		size_t fileSize = 4096;
+		size_t fanOut = 4;
+		size_t depth = 8;
+		double commentDensity = 0.2;
+		uint32_t seed = 1;
+	};
+
+	struct TreeInfo
+	{
+		size_t files = 0;
+		uintmax_t bytes = 0;
+	};
+
+	/// Generate a deterministic source tree in the given folder, replacing any existing contents
+	TreeInfo GenerateTree(const std::filesystem::path & folder, const TreeParams & params);
+}
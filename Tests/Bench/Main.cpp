@@ -0,0 +1,242 @@
+/*
+The Heady library is distributed under the MIT License (MIT)
+https://opensource.org/licenses/MIT
+See LICENSE.TXT or Heady.h for license details.
+Copyright (c) 2018 James Boer
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../../Source/clara.hpp"
+#include "Bench.h"
+#include "Generator.h"
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+using namespace clara;
+
+namespace
+{
+	struct Configuration
+	{
+		std::string name;
+		Bench::TreeParams tree;
+	};
+
+	struct Phase
+	{
+		const char * name;
+		double seconds;
+		uintmax_t bytes;
+		long peakKilobytes;
+	};
+
+	// Linux can reset the peak resident set size, so each phase's peak is measured on its own.
+	// Elsewhere the peak covers the process up to the end of the phase.
+	void ResetPeakRss()
+	{
+#if defined(__linux__)
+		std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+	}
+
+	long PeakRssKilobytes()
+	{
+#if defined(_WIN32)
+		return 0;
+#elif defined(__linux__)
+		std::ifstream status("/proc/self/status");
+		std::string line;
+		while (std::getline(status, line))
+		{
+			if (line.compare(0, 6, "VmHWM:") == 0)
+				return std::strtol(line.c_str() + 6, nullptr, 10);
+		}
+		return 0;
+#else
+		rusage usage = {};
+		getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+		return usage.ru_maxrss / 1024;
+#else
+		return usage.ru_maxrss;
+#endif
+#endif
+	}
+
+	template <typename Function>
+	double Time(Function && function)
+	{
+		auto start = std::chrono::steady_clock::now();
+		function();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void Run(const Configuration & config, const std::filesystem::path & root, unsigned int jobs, int iterations)
+	{
+		auto folder = root / config.name;
+		auto info = Bench::GenerateTree(folder / "Source", config.tree);
+
+		Heady::Params params;
+		params.sourceFolder = (folder / "Source").string();
+		params.output = (folder / "Output.hpp").string();
+		params.recursiveScan = false;
+		params.jobs = jobs;
+
+		// Run the same phases as GenerateHeader, keeping the fastest time and the largest peak of each
+		std::vector<Phase> phases = { { "walk", 1e30, 0, 0 }, { "load", 1e30, 0, 0 }, { "emit", 1e30, 0, 0 }, { "write", 1e30, 0, 0 } };
+		for (int i = 0; i < iterations; ++i)
+		{
+			std::filesystem::remove(params.output);
+			Heady::DiskFileSystem fileSystem(jobs);
+			Heady::Detail::Arena arena;
+			std::vector<std::string> names;
+			std::unique_ptr<Heady::Detail::Context> context;
+			std::function<void()> steps[] =
+			{
+				[&]() { names = Heady::Detail::CollectSourceFiles(params, fileSystem); },
+				[&]()
+				{
+					context = std::make_unique<Heady::Detail::Context>(std::move(names), &arena);
+					context->inlineMacro = Heady::Detail::GetInlineMacro(params);
+					Heady::Detail::LoadSourceFiles(*context, fileSystem, params.jobs, nullptr);
+				},
+				[&]() { Heady::Detail::EmitHeader(*context, params); },
+				[&]() { Heady::Detail::WriteHeader(context->output, params.output); },
+			};
+			for (size_t p = 0; p < phases.size(); ++p)
+			{
+				ResetPeakRss();
+				phases[p].seconds = std::min(phases[p].seconds, Time(steps[p]));
+				phases[p].peakKilobytes = std::max(phases[p].peakKilobytes, PeakRssKilobytes());
+			}
+			uintmax_t bytes[] = { info.bytes, info.bytes, context->output.Size(), context->output.Size() };
+			for (size_t p = 0; p < phases.size(); ++p)
+				phases[p].bytes = bytes[p];
+		}
+
+		std::printf("\n%s: %zu files, %.2f MB, fan-out %zu, depth %zu, comments %.0f%%\n", config.name.c_str(), info.files,
+			static_cast<double>(info.bytes) / 1e6, config.tree.fanOut, config.tree.depth, config.tree.commentDensity * 100.0);
+		std::printf("  %-8s %12s %14s %12s %14s\n", "phase", "time (ms)", "files/s", "MB/s", "peak RSS (MB)");
+		double total = 0.0;
+		long peak = 0;
+		for (const auto & phase : phases)
+		{
+			total += phase.seconds;
+			peak = std::max(peak, phase.peakKilobytes);
+			std::printf("  %-8s %12.3f %14.0f %12.1f %14.1f\n", phase.name, phase.seconds * 1e3,
+				static_cast<double>(info.files) / phase.seconds, static_cast<double>(phase.bytes) / 1e6 / phase.seconds,
+				static_cast<double>(phase.peakKilobytes) / 1024.0);
+		}
+		std::printf("  %-8s %12.3f %14.0f %12.1f %14.1f\n", "total", total * 1e3,
+			static_cast<double>(info.files) / total, static_cast<double>(info.bytes) / 1e6 / total, static_cast<double>(peak) / 1024.0);
+	}
+
+	// Remove what Run generated for a configuration, leaving anything else in the folder alone
+	void Clean(const Configuration & config, const std::filesystem::path & root)
+	{
+		auto folder = root / config.name;
+		std::filesystem::remove_all(folder / "Source");
+		std::filesystem::remove(folder / "Output.hpp");
+		std::error_code ec;
+		if (std::filesystem::is_empty(folder, ec))
+			std::filesystem::remove(folder);
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	std::string preset = "default";
+	Bench::TreeParams custom;
+	custom.files = 0;
+	std::string folder = (std::filesystem::temp_directory_path() / "HeadyBench").string();
+	unsigned int jobs = 0;
+	int iterations = 3;
+	bool keep = false;
+	bool showHelp = false;
+	auto parser =
+		Opt(preset, "name")["-p"]["--preset"]("small (10 files), medium (1k), large (100k), all, or default (small and medium)") |
+		Opt(custom.files, "count")["-f"]["--files"]("generate a custom tree with this many files instead of a preset") |
+		Opt(custom.fileSize, "bytes")["--size"]("approximate size of each custom file") |
+		Opt(custom.fanOut, "count")["--fanout"]("local includes per custom file") |
+		Opt(custom.depth, "levels")["--depth"]("include depth of the custom tree") |
+		Opt(custom.commentDensity, "ratio")["--comments"]("fraction of custom lines that are comments") |
+		Opt(custom.seed, "seed")["--seed"]("random seed for the custom tree") |
+		Opt(folder, "folder")["--folder"]("folder to generate trees in") |
+		Opt(jobs, "count")["-j"]["--jobs"]("threads used to read and scan files (default: one per core)") |
+		Opt(iterations, "count")["-n"]["--iterations"]("runs per tree, keeping the fastest time of each phase") |
+		Opt(keep)["--keep"]("keep generated trees afterwards") |
+		Help(showHelp)
+		;
+
+	auto result = parser.parse(Args(argc, argv));
+	if (!result)
+	{
+		std::cerr << "Error in command line: " << result.errorMessage() << std::endl;
+		return 1;
+	}
+	else if (showHelp)
+	{
+		std::cout << "Heady benchmark, version " << Heady::GetVersionString() << "\n\n";
+		parser.writeToStream(std::cout);
+		return 0;
+	}
+
+	std::vector<Configuration> configs;
+	if (custom.files)
+	{
+		configs.push_back({ "custom", custom });
+	}
+	else
+	{
+		Bench::TreeParams small;
+		small.files = 10;
+		small.depth = 3;
+		Bench::TreeParams medium;
+		Bench::TreeParams large;
+		large.files = 100000;
+		large.fileSize = 2048;
+		large.depth = 12;
+		if (preset == "small" || preset == "default" || preset == "all")
+			configs.push_back({ "small", small });
+		if (preset == "medium" || preset == "default" || preset == "all")
+			configs.push_back({ "medium", medium });
+		if (preset == "large" || preset == "all")
+			configs.push_back({ "large", large });
+		if (configs.empty())
+		{
+			std::cerr << "Error: unknown preset " << preset << std::endl;
+			return 1;
+		}
+	}
+
+	try
+	{
+		// The folder itself is only removed if it was created here and nothing else is left in it
+		bool created = !std::filesystem::exists(folder);
+		for (const auto & config : configs)
+		{
+			Run(config, folder, jobs, std::max(1, iterations));
+			if (!keep)
+				Clean(config, folder);
+		}
+		std::error_code ec;
+		if (!keep && created && std::filesystem::is_empty(folder, ec))
+			std::filesystem::remove(folder);
+	}
+	catch (const std::exception & e)
+	{
+		std::cerr << "Error running benchmark.  " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,452 @@
+/*
+The Heady library is distributed under the MIT License (MIT)
+https://opensource.org/licenses/MIT
+See LICENSE.TXT or Heady.h for license details.
+Copyright (c) 2018 James Boer
+*/
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Regression.h"
+
+namespace
+{
+	int failures = 0;
+
+	void Check(bool condition, const char * test, const std::string & what)
+	{
+		if (condition)
+			return;
+		std::cerr << test << ": " << what << std::endl;
+		failures++;
+	}
+
+	bool Contains(const std::string & text, std::string_view part)
+	{
+		return text.find(part) != std::string::npos;
+	}
+
+	// Generate a header from files held in memory, in a folder named Source
+	std::string Generate(const std::vector<std::pair<std::string, std::string>> & files, Heady::Params params = Heady::Params())
+	{
+		Heady::MemoryFileSystem fileSystem;
+		for (const auto & [path, contents] : files)
+			fileSystem.Add("Source/" + path, contents);
+		params.sourceFolder = "Source";
+		std::string text;
+		Heady::StringSink sink(text);
+		Heady::GenerateHeader(params, fileSystem, sink);
+		return text;
+	}
+
+	void TestLexer()
+	{
+		// Includes in comments and literals aren't expanded, and everything but the include is
+		// copied as written
+		auto text = Generate(
+		{
+			{ "a.h",
+				"#pragma once\n"
+				"// #include \"b.h\"\n"
+				"/* #include \"b.h\" */\n"
+				"const char * s = \"#include \\\"b.h\\\" inline_t\";\n"
+				"const char * r = R\"x(\n#include \"b.h\"\n)x\";\n"
+				"int c = 'a' + 1'000;\n"
+				"#include \"b.h\"\n"
+				"inline_t int f() { return 0; }\n" },
+			{ "b.h", "#pragma once\nint b;\n" },
+		});
+		const std::string expected =
+			"\n\n// begin --- a.h --- \n\n"
+			"#pragma once\n"
+			"// #include \"b.h\"\n"
+			"/* #include \"b.h\" */\n"
+			"const char * s = \"#include \\\"b.h\\\" inline_t\";\n"
+			"const char * r = R\"x(\n#include \"b.h\"\n)x\";\n"
+			"int c = 'a' + 1'000;"
+			"\n\n// begin --- b.h --- \n\n"
+			"#pragma once\nint b;\n"
+			"\n\n// end --- b.h --- \n\n"
+			"\ninline int f() { return 0; }\n"
+			"\n\n// end --- a.h --- \n\n";
+		Check(text == expected, "Lexer", "unexpected output:\n" + text);
+
+		// A block comment spanning lines is a single space, so a # after code on the line it
+		// began on doesn't start a directive
+		text = Generate(
+		{
+			{ "a.h",
+				"int x; /*\n*/ #include \"b.h\"\n"
+				"/*\n*/ #include \"c.h\"\n" },
+			{ "b.h", "int b;\n" },
+			{ "c.h", "int c;\n" },
+		});
+		Check(Contains(text, "int x; /*\n*/ #include \"b.h\"\n") && text.find("int b;") > text.find("// end --- a.h"), "Lexer", "include after a comment following code expanded:\n" + text);
+		Check(Contains(text, "int c;"), "Lexer", "include after a comment beginning a line not expanded:\n" + text);
+	}
+
+	void TestInlineDefine()
+	{
+		// The macro is replaced in macro bodies, but not where it's defined or tested
+		auto text = Generate(
+		{
+			{ "a.h",
+				"#define inline_t\n"
+				"#define DECL inline_t int\n"
+				"#define F(x) \\\n\tinline_t x\n"
+				"#ifdef inline_t\n"
+				"#endif\n" },
+		});
+		Check(Contains(text, "#define inline_t\n"), "InlineDefine", "macro name replaced:\n" + text);
+		Check(Contains(text, "#define DECL inline int\n"), "InlineDefine", "macro body not replaced:\n" + text);
+		Check(Contains(text, "#define F(x) \\\n\tinline x\n"), "InlineDefine", "continued macro body not replaced:\n" + text);
+		Check(Contains(text, "#ifdef inline_t\n"), "InlineDefine", "conditional replaced:\n" + text);
+	}
+
+	void TestMinify()
+	{
+		// Spaces are kept where tokens would merge, including a sign after a number ending in an
+		// exponent letter, and a directive's line ends before an included file starts
+		Heady::Params params;
+		params.minify = true;
+		auto text = Generate(
+		{
+			{ "a.h",
+				"// License\n"
+				"int a = 0xE + 1;\n"
+				"float b = 1.e - 2;\n"
+				"int c = x.e + 1;\n"
+				"int d = 1e5 + 2;\n"
+				"int e = 0x1p + 1;\n"
+				"int f = a + +b;\n"
+				"#if 1\n"
+				"#include \"b.h\"\n"
+				"#endif\n"
+				"int g = 1'0E + 1; /* comment */\n" },
+			{ "b.h", "int b;\n" },
+		}, params);
+		const std::string expected =
+			"int a=0xE +1;float b=1.e -2;int c=x.e+1;int d=1e5+2;int e=0x1p +1;int f=a+ +b;\n"
+			"#if 1\n"
+			"int b;\n"
+			"#endif\n"
+			"int g=1'0E +1;\n";
+		Check(text == expected, "Minify", "unexpected output:\n" + text);
+	}
+
+	void TestEvaluator()
+	{
+		using Heady::Detail::MacroTable;
+		MacroTable macros;
+		macros.Define("A", 1);
+		macros.Define("V", 3);
+		macros.Define("E", std::nullopt);
+		macros.Undefine("U");
+		auto evaluates = [&](std::string_view directive, std::optional<bool> expected)
+		{
+			Check(macros.Evaluate(directive) == expected, "Evaluator", std::string(directive));
+		};
+		evaluates("if A + 1 == 2", true);
+		evaluates("if (A << 2) == 4 && V > 2", true);
+		evaluates("if V ? 0 : 1", false);
+		evaluates("if 0x10 == 16", true);
+		evaluates("if U", false);
+		evaluates("if defined U", false);
+		evaluates("if B", std::nullopt);
+		evaluates("if B || defined(A)", true);
+		evaluates("if E", std::nullopt);
+		evaluates("if defined(E)", true);
+		evaluates("ifndef A", false);
+		evaluates("elif !defined(U) && V >= 3", true);
+		evaluates("if 1 / 0", std::nullopt);
+
+		// Decided branches are dropped along with the includes in them, and other conditions are kept
+		Heady::Params params;
+		params.assumeDefined = { "LINUX", "VERSION=3" };
+		params.assumeUndefined = { "WIN" };
+		auto text = Generate(
+		{
+			{ "a.h",
+				"#if defined(LINUX) && VERSION >= 2\n"
+				"int linux2;\n"
+				"#elif defined(OTHER)\n"
+				"int other;\n"
+				"#endif\n"
+				"#ifdef WIN\n"
+				"#include \"win.h\"\n"
+				"#endif\n"
+				"#ifdef UNKNOWN\n"
+				"int unknown;\n"
+				"#endif\n" },
+			{ "win.h", "int win;\n" },
+		}, params);
+		Check(Contains(text, "int linux2;") && !Contains(text, "#if defined(LINUX)"), "Evaluator", "certain branch not kept bare:\n" + text);
+		Check(!Contains(text, "int other;") && !Contains(text, "OTHER"), "Evaluator", "ruled out branch kept:\n" + text);
+		Check(!Contains(text, "int win;") && !Contains(text, "win.h"), "Evaluator", "include in ruled out branch expanded:\n" + text);
+		Check(Contains(text, "#ifdef UNKNOWN\nint unknown;\n#endif"), "Evaluator", "undecided conditional changed:\n" + text);
+	}
+
+	void TestDeferredConditionals()
+	{
+		// Only the conditionals around a deferred file's includes reach the declarations, with the
+		// defines they test
+		Heady::Params params;
+		params.implementation = "IMPLEMENTATION";
+		auto text = Generate(
+		{
+			{ "a.cpp",
+				"#define USE_FAST HAVE_FAST\n"
+				"#define HAVE_FAST 1\n"
+				"#define UNUSED 1\n"
+				"#ifdef _WIN32\n"
+				"#include \"win.h\"\n"
+				"#endif\n"
+				"#if USE_FAST\n"
+				"#include \"fast.h\"\n"
+				"#endif\n"
+				"#ifdef DEBUG\n"
+				"int debug;\n"
+				"#endif\n"
+				"int a;\n" },
+			{ "fast.h", "int fast;\n" },
+			{ "win.h", "int win;\n" },
+		}, params);
+		auto implementation = text.find("#ifdef IMPLEMENTATION");
+		Check(implementation != std::string::npos, "DeferredConditionals", "no implementation section:\n" + text);
+		auto declarations = text.substr(0, implementation);
+		Check(Contains(declarations, "#ifdef _WIN32\n") && Contains(declarations, "int win;\n"), "DeferredConditionals", "conditional include not kept:\n" + text);
+		Check(Contains(declarations, "#define HAVE_FAST 1\n\n#define USE_FAST HAVE_FAST\n\n#if USE_FAST\n"), "DeferredConditionals", "tested defines not carried:\n" + text);
+		Check(!Contains(declarations, "DEBUG") && !Contains(declarations, "UNUSED") && !Contains(declarations, "int a;"), "DeferredConditionals", "unrelated directives in declarations:\n" + text);
+	}
+
+	void TestIncludable()
+	{
+		// Files left out for their extension are still emitted where a quoted include names them,
+		// but never on their own, and excluded files stay out
+		Heady::Params params;
+		params.recursiveScan = true;
+		params.excluded = "build/";
+		auto text = Generate(
+		{
+			{ "a.h",
+				"#include \"b.inc\"\n"
+				"#define X(name) int name;\n"
+				"#include \"detail/table.def\"\n"
+				"#include \"build/c.def\"\n" },
+			{ "b.inc", "int b;\n" },
+			{ "build/c.def", "int c;\n" },
+			{ "detail/table.def", "X(first)\n#include \"more.def\"\n" },
+			{ "detail/more.def", "X(second)\n" },
+			{ "notes.txt", "not code\n" },
+			{ "unused.def", "X(unused)\n" },
+		}, params);
+		Check(Contains(text, "int b;") && Contains(text, "X(first)") && Contains(text, "X(second)"), "Includable", "included file left out:\n" + text);
+		Check(text.find("X(first)") < text.find("X(second)") && text.find("X(second)") < text.find("// end --- a.h"), "Includable", "included file not expanded in place:\n" + text);
+		Check(!Contains(text, "not code") && !Contains(text, "X(unused)"), "Includable", "file not included was emitted:\n" + text);
+		Check(!Contains(text, "int c;"), "Includable", "excluded file included:\n" + text);
+	}
+
+	// Serves a file that changes to other contents of the same size after it's read a number of times
+	class ChangingFileSystem : public Heady::MemoryFileSystem
+	{
+	public:
+		ChangingFileSystem(std::string path, std::string changed, int reads) :
+			m_path(std::move(path)),
+			m_changed(std::move(changed)),
+			m_reads(reads)
+		{
+		}
+
+		Heady::FileContents Read(const std::string & path) override
+		{
+			if (path == m_path && ++reads > m_reads)
+				Add(m_path, m_changed);
+			return MemoryFileSystem::Read(path);
+		}
+
+		int reads = 0;
+
+	private:
+		std::string m_path;
+		std::string m_changed;
+		int m_reads;
+	};
+
+	void TestStreaming()
+	{
+		// A streamed file is read once to lex it and once to emit it, however many includes it
+		// has, and a file that changed in between isn't spliced into the header
+		auto generate = [](int reads, std::string & text)
+		{
+			ChangingFileSystem fileSystem("Source/a.h", "int y;\n#include \"b.h\"\nint z;\n", reads);
+			fileSystem.Add("Source/a.h", "int x;\n#include \"b.h\"\nint w;\n");
+			fileSystem.Add("Source/b.h", "int b;\n#include \"c.h\"\n");
+			fileSystem.Add("Source/c.h", "int c;\n");
+			Heady::Params params;
+			params.sourceFolder = "Source";
+			params.streaming = true;
+			Heady::StringSink sink(text);
+			try
+			{
+				Heady::GenerateHeader(params, fileSystem, sink);
+			}
+			catch (const std::runtime_error &)
+			{
+				return -1;
+			}
+			return fileSystem.reads;
+		};
+		std::string text;
+		Check(generate(2, text) == 2, "Streaming", "file read more than twice");
+		Check(Contains(text, "int x;") && Contains(text, "int w;") && Contains(text, "int c;"), "Streaming", "unexpected output:\n" + text);
+		text.clear();
+		Check(generate(1, text) == -1, "Streaming", "file changed after lexing was emitted:\n" + text);
+	}
+
+	void TestUpToDate()
+	{
+		// An output that already holds the header is left untouched, whether written or streamed
+		namespace fs = std::filesystem;
+		auto root = fs::temp_directory_path() / "HeadyRegressionUpToDate";
+		fs::remove_all(root);
+		fs::create_directories(root / "Source");
+		std::ofstream(root / "Source" / "a.h") << "#pragma once\nint a;\n";
+		Heady::Params params;
+		params.sourceFolder = (root / "Source").string();
+		params.output = (root / "Output.hpp").string();
+		for (bool streaming : { false, true })
+		{
+			params.streaming = streaming;
+			fs::remove(params.output);
+			Check(Heady::GenerateHeader(params), "UpToDate", "missing output not written");
+			auto written = fs::last_write_time(params.output);
+			Check(!Heady::GenerateHeader(params), "UpToDate", streaming ? "streamed output rewritten" : "output rewritten");
+			Check(fs::last_write_time(params.output) == written, "UpToDate", "unchanged output touched");
+		}
+		fs::remove_all(root);
+	}
+
+	void TestOutputCache()
+	{
+		// Restored outputs are copies stamped with the time they were restored, unless links are
+		// asked for, which keep the stored file's time
+		namespace fs = std::filesystem;
+		auto root = fs::temp_directory_path() / "HeadyRegressionCache";
+		fs::remove_all(root);
+		fs::create_directories(root / "Source");
+		std::ofstream(root / "Source" / "a.h") << "#include \"a.def\"\n";
+		std::ofstream(root / "Source" / "a.def") << "int a;\n";
+		Heady::Params params;
+		params.sourceFolder = (root / "Source").string();
+		params.output = (root / "Output.hpp").string();
+		params.cacheDir = (root / "Cache").string();
+		Heady::GenerateHeader(params);
+		auto restore = [&](bool link)
+		{
+			fs::remove(params.output);
+			params.cacheLink = link;
+			Heady::Stats stats;
+			Heady::GenerateHeader(params, &stats);
+			Check(stats.cacheHit, "OutputCache", "output not restored");
+			return fs::hard_link_count(params.output);
+		};
+		Check(restore(false) == 1, "OutputCache", "restored output linked by default");
+		auto stamped = fs::last_write_time(params.output);
+		if (restore(true) > 1)
+			Check(fs::last_write_time(params.output) <= stamped, "OutputCache", "linked output restamped");
+
+		// A change to a file only reached through an include isn't restored over
+		std::ofstream(root / "Source" / "a.def") << "int b;\n";
+		Heady::Stats stats;
+		Heady::GenerateHeader(params, &stats);
+		std::ostringstream output;
+		output << std::ifstream(params.output).rdbuf();
+		Check(!stats.cacheHit && Contains(output.str(), "int b;"), "OutputCache", "output restored after an included file changed");
+		fs::remove_all(root);
+	}
+
+	void TestGlob()
+	{
+		using Heady::Detail::Glob;
+		auto matches = [](std::string_view pattern, std::string_view path, bool expected)
+		{
+			Check(Glob(pattern).Matches(path) == expected, "Glob", std::string(pattern) + " against " + std::string(path));
+		};
+		matches("*.h", "a.h", true);
+		matches("*.h", "d/a.h", false);
+		matches("*.h", "a.hpp", false);
+		matches("src/**/*.h", "src/a.h", true);
+		matches("src/**/*.h", "src/x/y/a.h", true);
+		matches("src/**/*.h", "srcx/a.h", false);
+		matches("**/x.h", "x.h", true);
+		matches("**/x.h", "d/e/x.h", true);
+		matches("**/x.h", "ax.h", false);
+		matches("[!a]?.c", "bb.c", true);
+		matches("[!a]?.c", "ab.c", false);
+		matches("[a-c]*", "c.h", true);
+
+		// Excluded folders and files are left out of a recursive scan
+		Heady::Params params;
+		params.recursiveScan = true;
+		params.excluded = "build/ *_test.h";
+		auto text = Generate(
+		{
+			{ "a.h", "int a;\n" },
+			{ "a_test.h", "int test;\n" },
+			{ "build/b.h", "int build;\n" },
+			{ "detail/c.h", "int c;\n" },
+		}, params);
+		Check(Contains(text, "int a;") && Contains(text, "int c;"), "Glob", "selected file left out:\n" + text);
+		Check(!Contains(text, "int test;") && !Contains(text, "int build;"), "Glob", "excluded file kept:\n" + text);
+	}
+
+	void TestPartition()
+	{
+		using Heady::Detail::PartitionBySize;
+		auto partitions = [](const std::vector<uintmax_t> & sizes, size_t parts, const std::vector<size_t> & expected)
+		{
+			Check(PartitionBySize(sizes, parts) == expected, "Partition", std::to_string(sizes.size()) + " items into " + std::to_string(parts));
+		};
+		partitions({ 5, 5, 5, 5 }, 2, { 0, 2, 4 });
+		partitions({ 10, 1, 1, 1, 1 }, 2, { 0, 1, 5 });
+		partitions({ 1, 1, 1, 1, 10 }, 2, { 0, 4, 5 });
+		partitions({ 3, 3 }, 4, { 0, 1, 2, 2, 2 });
+		partitions({}, 3, { 0, 0, 0, 0 });
+	}
+}
+
+int main([[maybe_unused]]int argc, [[maybe_unused]]char ** argv)
+{
+	try
+	{
+		TestLexer();
+		TestInlineDefine();
+		TestMinify();
+		TestEvaluator();
+		TestDeferredConditionals();
+		TestIncludable();
+		TestStreaming();
+		TestUpToDate();
+		TestOutputCache();
+		TestGlob();
+		TestPartition();
+	}
+	catch (const std::exception & e)
+	{
+		std::cerr << "Error running regression tests.  " << e.what() << std::endl;
+		return 1;
+	}
+
+	if (failures)
+	{
+		std::cerr << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	return 0;
+}